@@ -0,0 +1,519 @@
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include "Bond.h"
+#include "Serial.h"
+#include "TCP.h"
+#include "Pool.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Timer.h"
+#include "Telemetry.h"
+#include "Capture.h"
+
+// Several TNCs, usually on radios tuned to different
+// channels, can carry the traffic of one interface.
+// Flows are hashed onto a table of slots, and each
+// link owns a share of the slots in proportion to its
+// estimated capacity, so a flow stays on one link and
+// its frames stay in order. When a link is lost its
+// slots are handed to the remaining links, and slots
+// only move between links that keep running when the
+// shares change. With striping, frames are spread
+// over the links one by one instead, and numbered so
+// that the receiving side can put them back in order.
+
+// Capacity estimates follow new samples with this
+// weight, and never drop below the floor, in bytes
+// per second, so that every link keeps some traffic
+#define BOND_CAPACITY_WEIGHT 0.25
+#define BOND_CAPACITY_MIN 10
+
+// Striped frames walk the slot table with a stride
+// that is coprime with its size, which interleaves
+// the links instead of sending runs to each of them
+#define BOND_STRIPE_STRIDE 37
+
+#define BOND_NO_OWNER 0xFF
+
+struct bond_link bond[BOND_MAX_LINKS+1];
+int bond_links = 0;
+bool bond_striped = false;
+
+uint8_t bond_table[BOND_SLOTS];
+int bond_up_links = 0;
+uint64_t bond_last_sample = 0;
+
+// Capacities are sampled, and lost links retried,
+// at a fixed interval
+static void bond_sample_due(void);
+struct timer bond_sample_timer = { .callback = bond_sample_due };
+
+uint8_t bond_read_buffer[512];
+uint8_t stripe_buffer[MAX_PAYLOAD+STRIPE_HEADER_LEN];
+uint16_t stripe_tx_seq = 0;
+struct kiss_encoded stripe_encoded;
+uint32_t stripe_counter = 0;
+
+// Striped frames that arrived ahead of a missing one
+// are held in the slot for their sequence number
+struct frame* reorder_slots[BOND_REORDER_WINDOW];
+int reorder_held = 0;
+uint16_t reorder_next = 0;
+bool reorder_synced = false;
+
+// Runs when the first held frame has waited too long
+// for the frames missing ahead of it
+static void reorder_skip(void);
+struct timer reorder_timer = { .callback = reorder_skip };
+
+extern bool daemonize;
+extern bool kiss_over_tcp;
+extern bool serial_reattach;
+extern int attached_tnc;
+extern int baudrate;
+extern int device_type;
+extern int tcp_state;
+extern void cleanup(void);
+extern void tnc_link_lost(void);
+extern void kiss_frame_output(int link, uint8_t* frame, int frame_len);
+extern void outage_flush(void);
+
+// Parses a PORT:BAUD specification of a serial TNC
+bool bond_add_link(char* spec) {
+    char* separator = strrchr(spec, ':');
+    if (bond_links == BOND_MAX_LINKS || separator == NULL || separator == spec) return false;
+
+    int link_baudrate = atoi(separator+1);
+    if (link_baudrate <= 0) return false;
+
+    struct bond_link* link = &bond[++bond_links];
+    link->path = (char*)malloc(separator-spec+1);
+    memcpy(link->path, spec, separator-spec);
+    link->path[separator-spec] = 0;
+    link->baudrate = link_baudrate;
+    link->fd = -1;
+    return true;
+}
+
+static bool bond_link_open(struct bond_link* link) {
+    int fd = open(link->path, O_RDWR | O_NOCTTY | O_SYNC | O_NDELAY | O_CLOEXEC);
+    if (fd < 0) return false;
+    fcntl(fd, F_SETFL, 0);
+    if (!setup_port(fd, link->baudrate)) {
+        close_port(fd);
+        return false;
+    }
+
+    link->fd = fd;
+    link->written = 0;
+    link->queued = 0;
+    kiss_decoder_reset(&link->decoder);
+    link->decoder.in_frame = false;
+    return true;
+}
+
+static int bond_link_fd(int index) {
+    return index == 0 ? attached_tnc : bond[index].fd;
+}
+
+// The part of a link's capacity that remains after
+// taking off the channel use its TNC reports
+static double bond_share(int index) {
+    double share = bond[index].capacity*(1-telemetry_channel_load(index));
+    return share > BOND_CAPACITY_MIN ? share : BOND_CAPACITY_MIN;
+}
+
+// Hands out the slots in proportion to the capacity
+// of the links that are up. Every such link gets at
+// least one slot, and slots whose owner is within its
+// new share keep their owner.
+static void bond_rebalance(void) {
+    int target[BOND_MAX_LINKS+1];
+    int count[BOND_MAX_LINKS+1];
+    double share[BOND_MAX_LINKS+1];
+    double total = 0;
+    int fastest = -1;
+
+    bond_up_links = 0;
+    for (int i = 0; i <= bond_links; i++) {
+        count[i] = 0;
+        target[i] = 0;
+        if (!bond[i].up) continue;
+        bond_up_links++;
+        share[i] = bond_share(i);
+        total += share[i];
+        if (fastest < 0 || share[i] > share[fastest]) fastest = i;
+    }
+    if (bond_up_links == 0) return;
+
+    int assigned = 0;
+    for (int i = 0; i <= bond_links; i++) {
+        if (!bond[i].up) continue;
+        target[i] = 1 + (int)((BOND_SLOTS-bond_up_links)*share[i]/total);
+        assigned += target[i];
+    }
+    target[fastest] += BOND_SLOTS-assigned;
+
+    for (int slot = 0; slot < BOND_SLOTS; slot++) {
+        int owner = bond_table[slot];
+        if (owner != BOND_NO_OWNER && count[owner] < target[owner]) {
+            count[owner]++;
+        } else {
+            bond_table[slot] = BOND_NO_OWNER;
+        }
+    }
+
+    int next = 0;
+    for (int slot = 0; slot < BOND_SLOTS; slot++) {
+        if (bond_table[slot] != BOND_NO_OWNER) continue;
+        while (count[next] >= target[next]) next++;
+        bond_table[slot] = next;
+        count[next]++;
+    }
+}
+
+// The first TNC is connected and lost by its own
+// transport, so its state is picked up from there
+static void bond_check_primary(void) {
+    bool up = attached_tnc >= 0 && (!kiss_over_tcp || tcp_state == TCP_CONNECTED);
+    if (up != bond[0].up) {
+        bond[0].up = up;
+        bond[0].written = 0;
+        bond[0].queued = 0;
+        bond_rebalance();
+    }
+}
+
+static void bond_link_lost(int index) {
+    if (index == 0) {
+        if (kiss_over_tcp || serial_reattach) tnc_link_lost();
+        bond_check_primary();
+        return;
+    }
+
+    struct bond_link* link = &bond[index];
+    if (link->fd < 0) return;
+    if (daemonize) {
+        syslog(LOG_ERR, "Lost connection to bonded TNC at %s", link->path);
+    } else {
+        printf("Lost connection to bonded TNC at %s\r\n", link->path);
+    }
+    close_port(link->fd);
+    kiss_discard_pending(link->fd);
+    link->fd = -1;
+    link->up = false;
+    bond_rebalance();
+}
+
+void open_bond(void) {
+    // Links start out with the capacity of their serial
+    // line, and a first TNC without one is assumed to
+    // be as fast as the others on average
+    double capacity_sum = 0;
+    for (int i = 1; i <= bond_links; i++) {
+        if (!bond_link_open(&bond[i])) {
+            printf("Error: Could not open bonded TNC at %s\r\n", bond[i].path);
+            cleanup();
+            exit(1);
+        }
+        bond[i].up = true;
+        bond[i].capacity = bond[i].baudrate/10.0;
+        capacity_sum += bond[i].capacity;
+    }
+    bond[0].fd = -1;
+    bond[0].capacity = baudrate > 0 ? baudrate/10.0 : capacity_sum/bond_links;
+
+    memset(bond_table, BOND_NO_OWNER, sizeof(bond_table));
+    bond_check_primary();
+    bond_rebalance();
+    bond_last_sample = timer_now();
+    timer_arm(&bond_sample_timer, BOND_SAMPLE_INTERVAL);
+}
+
+void close_bond(void) {
+    for (int i = 1; i <= bond_links; i++) {
+        if (bond[i].fd >= 0) close_port(bond[i].fd);
+        bond[i].fd = -1;
+        bond[i].up = false;
+    }
+    for (int i = 0; i < BOND_REORDER_WINDOW; i++) {
+        if (reorder_slots[i] != NULL) frame_release(reorder_slots[i]);
+        reorder_slots[i] = NULL;
+    }
+    reorder_held = 0;
+}
+
+bool bond_available(void) {
+    bond_check_primary();
+    return bond_up_links > 0;
+}
+
+static uint32_t bond_hash(uint32_t hash, uint8_t* data, int len) {
+    for (int i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Hashes the addresses, protocol and ports of IP
+// packets, so that every flow maps to one slot.
+// Other frames are hashed by their link header.
+static int bond_flow_slot(uint8_t* frame, int frame_len) {
+    int offset = device_type == IF_TAP ? ETHERNET_MIN_FRAME_SIZE : 4;
+    uint32_t hash = 2166136261;
+    uint8_t* ip = frame+offset;
+    int ip_len = frame_len-offset;
+    uint16_t protocol = frame[offset-2] << 8 | frame[offset-1];
+
+    if (protocol == 0x0800 && ip_len >= 20) {
+        int header_len = (ip[0] & 0x0F)*4;
+        bool fragment = ((ip[6] & 0x3F) | ip[7]) != 0;
+        hash = bond_hash(hash, ip+9, 1);
+        hash = bond_hash(hash, ip+12, 8);
+        if ((ip[9] == 6 || ip[9] == 17) && !fragment && ip_len >= header_len+4) hash = bond_hash(hash, ip+header_len, 4);
+    } else if (protocol == 0x86DD && ip_len >= 40) {
+        hash = bond_hash(hash, ip+6, 1);
+        hash = bond_hash(hash, ip+8, 32);
+        if ((ip[6] == 6 || ip[6] == 17) && ip_len >= 44) hash = bond_hash(hash, ip+40, 4);
+    } else {
+        hash = bond_hash(hash, frame, frame_len < offset ? frame_len : offset);
+    }
+    return (hash ^ hash >> 16) % BOND_SLOTS;
+}
+
+// Writes a data frame to the link that owns its flow,
+// or to the next link in turn when striping. Returns
+// the result of the write, or BOND_NO_LINK if there
+// is no link to write to. Frames are captured on the
+// link they were written to, without the stripe header.
+int bond_transmit(uint8_t* frame, int frame_len) {
+    if (!bond_available()) return BOND_NO_LINK;
+
+    uint8_t* data = frame;
+    int data_len = frame_len;
+    int index;
+    if (bond_striped) {
+        if (frame_len+STRIPE_HEADER_LEN > MAX_PAYLOAD) return -1;
+        index = bond_table[(stripe_counter++*BOND_STRIPE_STRIDE) % BOND_SLOTS];
+        stripe_buffer[0] = stripe_tx_seq >> 8;
+        stripe_buffer[1] = stripe_tx_seq & 0xFF;
+        memcpy(stripe_buffer+STRIPE_HEADER_LEN, frame, frame_len);
+        stripe_tx_seq++;
+        frame = stripe_buffer;
+        frame_len += STRIPE_HEADER_LEN;
+    } else {
+        index = bond_table[bond_flow_slot(frame, frame_len)];
+    }
+
+    int written = kiss_write_link_frame(bond_link_fd(index), index, frame, frame_len);
+    bool busy = written < 0 && errno == EAGAIN;
+    LOG(LOG_DEBUG, "Wrote %d bytes to bonded link %d", written, index);
+    if (busy) {
+        // Only a TCP TNC as the first link can be busy
+        METRIC_INC(drops_tnc_busy);
+    } else if (written < 0) {
+        bond_link_lost(index);
+    } else {
+        bond[index].written += written;
+        capture_frame(index, CAPTURE_TX, data, data_len, CAPTURE_PASSED);
+    }
+    return written;
+}
+
+// Frames that are not part of the data flows, like
+// station identification, are sent on every link.
+// When striping, the frame is given a sequence number
+// like any other, so the receiving side does not take
+// its first bytes for one. The copies that arrive
+// after the first are behind their turn, and are
+// delivered as they come.
+void bond_transmit_all(struct kiss_encoded* encoded, uint8_t* frame, int frame_len) {
+    bond_check_primary();
+    if (bond_striped) {
+        if (frame_len+STRIPE_HEADER_LEN > MAX_PAYLOAD) return;
+        stripe_buffer[0] = stripe_tx_seq >> 8;
+        stripe_buffer[1] = stripe_tx_seq & 0xFF;
+        memcpy(stripe_buffer+STRIPE_HEADER_LEN, frame, frame_len);
+        stripe_tx_seq++;
+        kiss_encode_once(&stripe_encoded, stripe_buffer, frame_len+STRIPE_HEADER_LEN);
+        encoded = &stripe_encoded;
+    }
+
+    for (int i = 0; i <= bond_links; i++) {
+        if (!bond[i].up) continue;
+        int written = kiss_write_encoded(bond_link_fd(i), i, encoded);
+        if (written >= 0) {
+            bond[i].written += written;
+        } else if (errno != EAGAIN) {
+            bond_link_lost(i);
+        }
+    }
+}
+
+// Estimates the capacity of each link from how fast
+// its output queue drains. Only intervals where the
+// queue stayed busy show what the link can carry, at
+// other times the estimate is raised to what it did
+// carry if that was more.
+static void bond_sample(uint64_t now) {
+    double elapsed = (now-bond_last_sample)/1e9;
+    bond_last_sample = now;
+    if (elapsed <= 0) return;
+
+    for (int i = 0; i <= bond_links; i++) {
+        struct bond_link* link = &bond[i];
+        if (!link->up) continue;
+
+        int queued = 0;
+        if (ioctl(bond_link_fd(i), TIOCOUTQ, &queued) < 0) queued = 0;
+        long long drained = link->written+link->queued-queued;
+        double rate = drained > 0 ? drained/elapsed : 0;
+
+        if (link->queued > 0 && queued > 0) {
+            link->capacity += (rate-link->capacity)*BOND_CAPACITY_WEIGHT;
+        } else if (rate > link->capacity) {
+            link->capacity = rate;
+        }
+        if (link->capacity < BOND_CAPACITY_MIN) link->capacity = BOND_CAPACITY_MIN;
+        link->written = 0;
+        link->queued = queued;
+    }
+}
+
+// Lost links are retried at every sample, and frames
+// held while no link was up are sent once one is back
+static void bond_retry(void) {
+    bool reopened = false;
+    for (int i = 1; i <= bond_links; i++) {
+        if (bond[i].up || !bond_link_open(&bond[i])) continue;
+        bond[i].up = true;
+        reopened = true;
+        if (daemonize) {
+            syslog(LOG_NOTICE, "Reattached bonded TNC at %s", bond[i].path);
+        } else {
+            printf("Reattached bonded TNC at %s\r\n", bond[i].path);
+        }
+    }
+    if (reopened) {
+        bond_rebalance();
+        outage_flush();
+    }
+}
+
+static void reorder_release(void) {
+    while (reorder_held > 0) {
+        int slot = reorder_next % BOND_REORDER_WINDOW;
+        struct frame* held = reorder_slots[slot];
+        if (held == NULL) break;
+        reorder_slots[slot] = NULL;
+        reorder_held--;
+        reorder_next++;
+        kiss_frame_output(held->link_id, held->data, held->len);
+        frame_release(held);
+    }
+    if (reorder_held > 0) {
+        timer_arm(&reorder_timer, BOND_REORDER_TIMEOUT);
+    } else {
+        timer_cancel(&reorder_timer);
+    }
+}
+
+// Gives up on the missing frames ahead of the first
+// held frame
+static void reorder_skip(void) {
+    while (reorder_held > 0 && reorder_slots[reorder_next % BOND_REORDER_WINDOW] == NULL) reorder_next++;
+    reorder_release();
+}
+
+// Puts striped frames back in order before they are
+// delivered. Frames that arrive after their turn was
+// given up on are delivered right away, since a late
+// frame is still better than a lost one, and a jump
+// outside the window means the sending side started
+// over, so everything held is delivered as it is.
+void bond_reorder(int link, uint8_t* frame, int frame_len) {
+    if (frame_len < STRIPE_HEADER_LEN) {
+        METRIC_INC(filter_undersized);
+        return;
+    }
+    uint16_t seq = frame[0] << 8 | frame[1];
+    frame += STRIPE_HEADER_LEN;
+    frame_len -= STRIPE_HEADER_LEN;
+
+    if (!reorder_synced) {
+        reorder_next = seq;
+        reorder_synced = true;
+    }
+
+    int16_t distance = seq-reorder_next;
+    if (distance >= BOND_REORDER_WINDOW || distance < -BOND_REORDER_WINDOW) {
+        while (reorder_held > 0) reorder_skip();
+        reorder_next = seq;
+        distance = 0;
+    }
+
+    if (distance < 0) {
+        kiss_frame_output(link, frame, frame_len);
+    } else if (distance == 0) {
+        kiss_frame_output(link, frame, frame_len);
+        reorder_next++;
+        reorder_release();
+    } else {
+        int slot = seq % BOND_REORDER_WINDOW;
+        if (reorder_slots[slot] != NULL) return;
+
+        struct frame* held = frame_alloc();
+        if (held == NULL) {
+            kiss_frame_output(link, frame, frame_len);
+            return;
+        }
+        memcpy(held->data, frame, frame_len);
+        held->len = frame_len;
+        held->link_id = link;
+        reorder_slots[slot] = held;
+        reorder_held++;
+        if (!reorder_timer.armed) timer_arm(&reorder_timer, BOND_REORDER_TIMEOUT);
+    }
+}
+
+static void bond_sample_due(void) {
+    timer_arm(&bond_sample_timer, BOND_SAMPLE_INTERVAL);
+    bond_check_primary();
+    bond_sample(timer_now());
+    bond_retry();
+    bond_rebalance();
+}
+
+int bond_poll_fds(struct pollfd* fds) {
+    for (int i = 1; i <= bond_links; i++) {
+        fds[i-1].fd = bond[i].fd;
+        fds[i-1].events = POLLIN;
+        fds[i-1].revents = 0;
+    }
+    return bond_links;
+}
+
+// The bonded TNCs are read on the main thread, each
+// through its own decoder
+void bond_poll_events(struct pollfd* fds, int n_fds) {
+    for (int i = 1; i <= n_fds; i++) {
+        struct bond_link* link = &bond[i];
+        short revents = fds[i-1].revents;
+        if (link->fd < 0 || revents == 0) continue;
+
+        if (revents & (POLLHUP | POLLERR)) {
+            bond_link_lost(i);
+            continue;
+        }
+
+        if (revents & POLLIN) {
+            int len = read(link->fd, bond_read_buffer, sizeof(bond_read_buffer));
+            if (len <= 0) {
+                bond_link_lost(i);
+                continue;
+            }
+            for (int j = 0; j < len; j++) kiss_link_read(i, &link->decoder, bond_read_buffer[j]);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include "Constants.h"
+#include "KISS.h"
+
+#define BOND_MAX_FDS BOND_MAX_LINKS
+
+// Returned by bond_transmit when no link is up
+#define BOND_NO_LINK -2
+
+// Striped frames carry a sequence number in front
+// of the frame, in network byte order
+#define STRIPE_HEADER_LEN 2
+
+// One TNC of a bond. Link 0 is the TNC attached by
+// the normal transport options, and is only tracked
+// here. The others are serial TNCs owned by the bond.
+// Capacities are estimated in bytes per second.
+struct bond_link {
+    char* path;
+    int baudrate;
+    int fd;
+    bool up;
+    double capacity;
+    long long written;
+    int queued;
+    struct kiss_decoder decoder;
+};
+
+extern int bond_links;
+extern bool bond_striped;
+
+bool bond_add_link(char* spec);
+void open_bond(void);
+void close_bond(void);
+bool bond_available(void);
+int bond_transmit(uint8_t* frame, int frame_len);
+void bond_transmit_all(struct kiss_encoded* encoded, uint8_t* frame, int frame_len);
+void bond_reorder(int link, uint8_t* frame, int frame_len);
+int bond_poll_fds(struct pollfd* fds);
+void bond_poll_events(struct pollfd* fds, int n_fds);
+
+#endif
@@ -0,0 +1,245 @@
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include "Capture.h"
+#include "Metrics.h"
+
+// The capture file is preallocated and mapped, so
+// recording a frame is a copy into the page cache,
+// and a slow disk never stalls the data path. The
+// file is used as a ring. After the header blocks,
+// every byte is always covered by a valid block, with
+// free space covered by a skippable custom block, so
+// the file can be opened by pcapng readers at any
+// time. Once the ring wraps, the newest frames are
+// found before the oldest ones in the file.
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_CB_NOCOPY 0x40000BAD
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+#define OPT_ENDOFOPT 0
+#define OPT_COMMENT 1
+#define OPT_IF_NAME 2
+#define OPT_IF_DESCRIPTION 3
+#define OPT_IF_TSRESOL 9
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+
+#define TUN_PI_LEN 4
+#define PAD_MIN_LEN 16
+
+uint8_t* capture_map = NULL;
+size_t capture_size = 0;
+size_t capture_data_start = 0;
+size_t capture_head = 0;
+size_t capture_free_end = 0;
+int capture_fd = -1;
+int capture_snaplen = 0;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int device_type;
+extern char if_name[];
+extern char port_if_names[KISS_MAX_PORTS][IFNAMSIZ];
+extern int kiss_ports;
+extern void cleanup(void);
+
+static inline size_t pad4(size_t len) {
+    return (len+3) & ~(size_t)3;
+}
+
+static void put32(size_t offset, uint32_t value) {
+    memcpy(capture_map+offset, &value, sizeof(value));
+}
+
+static uint32_t get32(size_t offset) {
+    uint32_t value;
+    memcpy(&value, capture_map+offset, sizeof(value));
+    return value;
+}
+
+static size_t put_option(size_t offset, uint16_t code, const void* data, uint16_t len) {
+    memcpy(capture_map+offset, &code, sizeof(code));
+    memcpy(capture_map+offset+2, &len, sizeof(len));
+    memset(capture_map+offset+4, 0, pad4(len));
+    memcpy(capture_map+offset+4, data, len);
+    return 4+pad4(len);
+}
+
+// Covers free space with a block readers will skip
+static void put_padding(size_t offset, size_t len) {
+    if (len == 0) return;
+    put32(offset, PCAPNG_CB_NOCOPY);
+    put32(offset+4, len);
+    put32(offset+8, 0);
+    put32(offset+len-4, len);
+}
+
+static size_t put_idb(size_t offset, const char* name, const char* description) {
+    size_t start = offset;
+    uint16_t linktype = device_type == IF_TAP ? LINKTYPE_ETHERNET : LINKTYPE_RAW;
+    uint16_t reserved = 0;
+    uint32_t snaplen = capture_snaplen;
+    uint8_t tsresol = 9;
+
+    put32(offset, PCAPNG_IDB);
+    offset += 8;
+    memcpy(capture_map+offset, &linktype, sizeof(linktype));
+    memcpy(capture_map+offset+2, &reserved, sizeof(reserved));
+    put32(offset+4, snaplen);
+    offset += 8;
+    offset += put_option(offset, OPT_IF_NAME, name, strlen(name));
+    offset += put_option(offset, OPT_IF_DESCRIPTION, description, strlen(description));
+    offset += put_option(offset, OPT_IF_TSRESOL, &tsresol, 1);
+    offset += put_option(offset, OPT_ENDOFOPT, NULL, 0);
+    put32(start+4, offset+4-start);
+    put32(offset, offset+4-start);
+    return offset+4-start;
+}
+
+void open_capture(char* path, int snaplen) {
+    capture_snaplen = snaplen > 0 ? snaplen : CAPTURE_MAX_SNAPLEN;
+    capture_size = CAPTURE_FILE_SIZE;
+
+    capture_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (capture_fd < 0) {
+        perror("Could not open capture file");
+        cleanup();
+        exit(1);
+    }
+
+    // Allocate all blocks up front, so that writing to
+    // the mapping can't fail later on a full disk.
+    if (posix_fallocate(capture_fd, 0, capture_size) != 0 && ftruncate(capture_fd, capture_size) < 0) {
+        perror("Could not allocate capture file");
+        cleanup();
+        exit(1);
+    }
+
+    capture_map = mmap(NULL, capture_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture_fd, 0);
+    if (capture_map == MAP_FAILED) {
+        capture_map = NULL;
+        perror("Could not map capture file");
+        cleanup();
+        exit(1);
+    }
+
+    size_t offset = 0;
+    uint32_t magic = PCAPNG_BYTE_ORDER_MAGIC;
+    uint16_t major = 1;
+    uint16_t minor = 0;
+    int64_t section_len = -1;
+    put32(offset, PCAPNG_SHB);
+    put32(offset+4, 28);
+    memcpy(capture_map+offset+8, &magic, sizeof(magic));
+    memcpy(capture_map+offset+12, &major, sizeof(major));
+    memcpy(capture_map+offset+14, &minor, sizeof(minor));
+    memcpy(capture_map+offset+16, &section_len, sizeof(section_len));
+    put32(offset+24, 28);
+    offset += 28;
+
+    // Interface IDs are link*2+direction. Ports are
+    // named after their interfaces, and bonded TNCs
+    // after the interface they are bonded to.
+    char link_name[IFNAMSIZ+8];
+    char name[IFNAMSIZ+16];
+    char description[64];
+    for (int link = 0; link < metrics_links(); link++) {
+        if (link == 0) {
+            snprintf(link_name, sizeof(link_name), "%s", if_name);
+        } else if (kiss_ports > 1) {
+            snprintf(link_name, sizeof(link_name), "%s", port_if_names[link]);
+        } else {
+            snprintf(link_name, sizeof(link_name), "%s-bond%d", if_name, link);
+        }
+        snprintf(name, sizeof(name), "%s-tx", link_name);
+        snprintf(description, sizeof(description), "Frames sent to the TNC on link %d", link);
+        offset += put_idb(offset, name, description);
+        snprintf(name, sizeof(name), "%s-rx", link_name);
+        snprintf(description, sizeof(description), "Frames received from the TNC on link %d", link);
+        offset += put_idb(offset, name, description);
+    }
+
+    capture_data_start = offset;
+    capture_head = offset;
+    capture_free_end = capture_size;
+    put_padding(capture_head, capture_free_end-capture_head);
+}
+
+void close_capture(void) {
+    if (capture_map != NULL) munmap(capture_map, capture_size);
+    if (capture_fd >= 0) close(capture_fd);
+    capture_map = NULL;
+    capture_fd = -1;
+}
+
+// Makes room for a block of the given length at the
+// write position, by taking over old blocks or by
+// wrapping around. The free space left behind must
+// either be empty or large enough for a padding block.
+static void capture_reserve(size_t len) {
+    while (capture_free_end-capture_head != len && capture_free_end-capture_head < len+PAD_MIN_LEN) {
+        if (capture_free_end == capture_size) {
+            capture_head = capture_data_start;
+            capture_free_end = capture_data_start;
+        } else {
+            capture_free_end += get32(capture_free_end+4);
+        }
+    }
+}
+
+void capture_frame(int link, int direction, uint8_t* frame, int frame_len, int verdict) {
+    if (capture_map == NULL) return;
+
+    // The TUN packet information header is not part of
+    // the captured frame, which starts at the IP header.
+    if (device_type == IF_TUN) {
+        if (frame_len <= TUN_PI_LEN) return;
+        frame += TUN_PI_LEN;
+        frame_len -= TUN_PI_LEN;
+    }
+
+    const char* comment = NULL;
+    if (verdict == CAPTURE_FILTERED) comment = "Dropped by filter";
+    if (verdict == CAPTURE_UNDELIVERED) comment = "Not written to interface";
+
+    int captured_len = frame_len < capture_snaplen ? frame_len : capture_snaplen;
+    size_t len = 32+pad4(captured_len);
+    if (comment != NULL) len += 4+pad4(strlen(comment))+4;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t timestamp = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+
+    // Reader threads capture too, but the lock is only
+    // ever held for the time it takes to copy a frame.
+    pthread_mutex_lock(&capture_lock);
+    capture_reserve(len);
+
+    size_t offset = capture_head;
+    put32(offset, PCAPNG_EPB);
+    put32(offset+4, len);
+    put32(offset+8, link*2+direction);
+    put32(offset+12, timestamp >> 32);
+    put32(offset+16, timestamp & 0xFFFFFFFF);
+    put32(offset+20, captured_len);
+    put32(offset+24, frame_len);
+    if (captured_len > 0) memset(capture_map+offset+28+pad4(captured_len)-4, 0, 4);
+    memcpy(capture_map+offset+28, frame, captured_len);
+    offset += 28+pad4(captured_len);
+    if (comment != NULL) {
+        offset += put_option(offset, OPT_COMMENT, comment, strlen(comment));
+        offset += put_option(offset, OPT_ENDOFOPT, NULL, 0);
+    }
+    put32(offset, len);
+
+    capture_head += len;
+    put_padding(capture_head, capture_free_end-capture_head);
+    pthread_mutex_unlock(&capture_lock);
+}
@@ -0,0 +1,27 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "Constants.h"
+
+// Frames are captured per link and direction, each
+// pair having its own pcapng interface description.
+#define CAPTURE_TX 0
+#define CAPTURE_RX 1
+
+// Reasons a captured frame did not make it through,
+// recorded as a comment on the packet.
+#define CAPTURE_PASSED 0
+#define CAPTURE_FILTERED 1
+#define CAPTURE_UNDELIVERED 2
+
+void open_capture(char* path, int snaplen);
+void close_capture(void);
+void capture_frame(int link, int direction, uint8_t* frame, int frame_len, int verdict);
+
+#endif
@@ -10,6 +10,150 @@
 
 #define TXQUEUELEN 10
 
-// ARP timings, in seconds
+// ARP and ND timings, in seconds
 #define ARP_BASE_REACHABLE_TIME 300
-#define ARP_RETRANS_TIME 5
\ No newline at end of file
+#define ARP_RETRANS_TIME 5
+
+// Interval between attempts to transmit a station
+// identification held back while the TNC is not
+// reachable, in milliseconds
+#define ID_RETRY_INTERVAL 1000
+
+// Identification may go out this share of the interval
+// ahead of its deadline, in percent, when it can be
+// appended to a data frame or the channel is idle. The
+// channel counts as idle when nothing was sent or
+// received for the given time, in milliseconds.
+#define ID_EARLY_PERCENT 10
+#define ID_IDLE_TIME 1500
+
+// KISS ports of one TNC that can each be attached as
+// an interface of their own
+#define KISS_MAX_PORTS 8
+
+// Slots in the timer wheel, and the length of one
+// slot in milliseconds
+#define TIMER_WHEEL_SLOTS 256
+#define TIMER_TICK 1
+
+// KISS over TCP reconnection, in milliseconds
+#define TCP_CONNECT_TIMEOUT 5000
+#define TCP_BACKOFF_MIN 250
+#define TCP_BACKOFF_MAX 30000
+
+// Addresses of the TNC host that are tried in turn
+#define TCP_MAX_ADDRS 8
+
+// TCP keepalive timings, in seconds
+#define TCP_KEEPALIVE_IDLE 10
+#define TCP_KEEPALIVE_INTERVAL 5
+#define TCP_KEEPALIVE_COUNT 3
+
+// Space for the rtnetlink requests that configure
+// the interface, and the number of requests
+#define NETLINK_BATCH_SIZE 4096
+#define NETLINK_BATCH_MSGS 16
+
+// Frames held while the TNC is reconnecting, and
+// the age in seconds after which they are dropped
+#define OUTAGE_QUEUE_LEN 32
+#define OUTAGE_MAX_AGE 30
+
+// Interval between attempts to reopen a serial
+// TNC that has disappeared, in milliseconds
+#define SERIAL_REATTACH_INTERVAL 1000
+
+// TNCs bonded with the first one, the slots in the
+// table that spreads flows over the bonded links, and
+// the interval in milliseconds between estimates of
+// their capacity
+#define BOND_MAX_LINKS 4
+#define BOND_SLOTS 64
+#define BOND_SAMPLE_INTERVAL 1000
+
+// Links that are counted and captured on their own,
+// either bonded TNCs or the ports of a multi-port
+// TNC, which can't be combined
+#define TNC_MAX_LINKS (KISS_MAX_PORTS > BOND_MAX_LINKS+1 ? KISS_MAX_PORTS : BOND_MAX_LINKS+1)
+
+// Striped frames held back to restore their order,
+// and the time in milliseconds a missing frame is
+// waited for
+#define BOND_REORDER_WINDOW 32
+#define BOND_REORDER_TIMEOUT 250
+
+// Received frames remembered to drop duplicates, the
+// slots a frame may be stored in, and the time in
+// milliseconds within which a copy counts as one
+#define DEDUP_SLOTS 256
+#define DEDUP_PROBES 8
+#define DEDUP_WINDOW 2000
+
+// Priority classes for frames sent to the TNC, the
+// default and largest number of frames queued in each
+// class, and the frames of the normal class sent for
+// every bulk frame while both are waiting. Frames are
+// only handed to the TNC while fewer than the given
+// bytes are waiting in its output queue, which is
+// checked again after the given interval, in
+// milliseconds, when its speed is not known.
+#define PRIORITY_CLASSES 3
+#define PRIORITY_QUEUE_INTERACTIVE 16
+#define PRIORITY_QUEUE_NORMAL 32
+#define PRIORITY_QUEUE_BULK 64
+#define PRIORITY_QUEUE_MAX 256
+#define PRIORITY_NORMAL_WEIGHT 4
+#define PRIORITY_TNC_BACKLOG 128
+#define PRIORITY_POLL_INTERVAL 10
+
+// KISS server clients, and the limits on frames and
+// bytes queued for each client before it is dropped
+#define SERVER_MAX_CLIENTS 16
+#define SERVER_CLIENT_QUEUE_LEN 64
+#define SERVER_CLIENT_QUEUE_BYTES 65536
+
+// Frames in the pool beyond what the queues can hold
+#define FRAME_POOL_SPARE 8
+
+// Shared memory frame rings, slot count per direction
+#define SHM_RING_SLOTS 64
+
+// Frame ring slots between pipeline threads, and
+// the number of interface queues with their own
+// reader thread
+#define PIPELINE_RING_SLOTS 64
+#define IF_MAX_QUEUES 8
+
+// io_uring submission queue entries
+#define URING_ENTRIES 64
+
+// Stations whose signal is tracked in TAP mode, and
+// the age in seconds after which status reports from
+// the TNC are no longer taken into account. Signal
+// strength is reported offset by RSSI_OFFSET.
+#define TELEMETRY_SOURCES 32
+#define TELEMETRY_MAX_AGE 10
+#define RSSI_OFFSET 157
+
+// Metrics output buffer, and the interval in
+// seconds between writes of the metrics file
+#define METRICS_BUFFER_SIZE 131072
+#define METRICS_FILE_INTERVAL 15
+
+// Log records waiting to be written, the time in
+// milliseconds records are gathered for before they
+// are written, and
+// the messages a rate limited log statement may
+// write per interval in seconds
+#define LOG_RING_SLOTS 1024
+#define LOG_FLUSH_INTERVAL 20
+#define LOG_RATE_BURST 10
+#define LOG_RATE_INTERVAL 5
+
+// Entries kept in the built-in trace ring
+#define TRACE_RING_LEN 4096
+
+// Size of the preallocated pcapng capture ring file,
+// and the snapshot length used when none is given
+#define CAPTURE_FILE_SIZE (16*1024*1024)
+#define CAPTURE_MAX_SNAPLEN 65535
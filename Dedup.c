@@ -0,0 +1,53 @@
+#include "Dedup.h"
+
+// Frames heard more than once, from overlapping
+// receivers or over several bonded links, are only
+// passed on the first time. Frames are remembered by
+// a 64 bit FNV-1a fingerprint in an open addressed
+// table, with the time they were first seen. Entries
+// older than DEDUP_WINDOW count as free, and when all
+// slots a fingerprint may go in are taken, the oldest
+// of them is reused, so the table never grows. This
+// runs on the main thread only.
+
+#define DEDUP_EMPTY 0
+
+struct dedup_entry {
+    uint64_t fingerprint;
+    uint64_t seen;
+};
+
+struct dedup_entry dedup_table[DEDUP_SLOTS];
+
+static uint64_t dedup_fingerprint(int port, uint8_t* frame, int frame_len) {
+    uint64_t hash = 14695981039346656037ULL ^ port;
+    for (int i = 0; i < frame_len; i++) {
+        hash ^= frame[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash != DEDUP_EMPTY ? hash : 1;
+}
+
+// Returns true if the same frame was seen on the same
+// port within the window, and remembers it either way
+bool dedup_seen(int port, uint8_t* frame, int frame_len, uint64_t now) {
+    uint64_t fingerprint = dedup_fingerprint(port, frame, frame_len);
+    uint64_t window = (uint64_t)DEDUP_WINDOW*1000000;
+    struct dedup_entry* oldest = NULL;
+
+    for (int i = 0; i < DEDUP_PROBES; i++) {
+        struct dedup_entry* entry = &dedup_table[(fingerprint+i) % DEDUP_SLOTS];
+        bool expired = entry->fingerprint == DEDUP_EMPTY || now-entry->seen > window;
+        if (!expired && entry->fingerprint == fingerprint) return true;
+        if (expired) {
+            if (oldest == NULL || oldest->fingerprint != DEDUP_EMPTY) oldest = entry;
+            entry->fingerprint = DEDUP_EMPTY;
+        } else if (oldest == NULL || (oldest->fingerprint != DEDUP_EMPTY && entry->seen < oldest->seen)) {
+            oldest = entry;
+        }
+    }
+
+    oldest->fingerprint = fingerprint;
+    oldest->seen = now;
+    return false;
+}
@@ -0,0 +1,13 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "Constants.h"
+
+bool dedup_seen(int port, uint8_t* frame, int frame_len, uint64_t now);
+
+#endif
@@ -1,85 +1,520 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include "KISS.h"
 #include "Serial.h"
+#include "Server.h"
+#include "SHM.h"
+#include "Pipeline.h"
+#include "Bond.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Telemetry.h"
+#include "Ports.h"
+#include "Dedup.h"
 
-int frame_len;
-bool IN_FRAME;
-bool ESCAPE;
-
-uint8_t kiss_command = CMD_UNKNOWN;
+struct kiss_decoder tnc_decoder = { .command = CMD_UNKNOWN };
+uint64_t tnc_last_rx = 0;
 uint8_t frame_buffer[MAX_PAYLOAD];
 uint8_t write_buffer[MAX_PAYLOAD*2+3];
 
-extern bool verbose;
+// The rest of a frame that a nonblocking TNC socket
+// only took part of. It is written before any other
+// frame once the socket takes data again, so frames
+// are never cut apart on the stream. Until then,
+// writes to that socket fail with EAGAIN. Only the
+// KISS over TCP socket is nonblocking, so there is
+// never more than one remainder held.
+uint8_t kiss_pending[sizeof(write_buffer)+sizeof(((struct kiss_encoded*)0)->data)];
+int kiss_pending_len = 0;
+int kiss_pending_offset = 0;
+int kiss_pending_fd = -1;
+
+// Data frames for each KISS port start with the port
+// in the high nibble of the command byte
+uint8_t frame_start[KISS_MAX_PORTS][2] = {
+    { FEND, CMD_DATA }, { FEND, 0x10 | CMD_DATA }, { FEND, 0x20 | CMD_DATA }, { FEND, 0x30 | CMD_DATA },
+    { FEND, 0x40 | CMD_DATA }, { FEND, 0x50 | CMD_DATA }, { FEND, 0x60 | CMD_DATA }, { FEND, 0x70 | CMD_DATA },
+};
+uint8_t frame_end[] = { FEND };
+uint8_t escaped_fend[] = { FESC, TFEND };
+uint8_t escaped_fesc[] = { FESC, TFESC };
+
 extern bool daemonize;
 extern int attached_if;
 extern int device_type;
+extern int baudrate;
+extern bool kiss_server;
+extern bool shm_rings;
+extern bool threaded;
+extern bool dedup_frames;
 extern void cleanup(void);
 
-void kiss_frame_received(int frame_len) {
+// Passes a decoded data frame from the given link
+// to all its consumers
+void kiss_frame_output(int link, uint8_t* frame, int frame_len) {
+    // Server clients see every data frame, including
+    // frames that are not meant for the interface
+    if (kiss_server) server_broadcast(frame, frame_len);
+    if (shm_rings) shm_deliver(frame, frame_len);
+    histogram_record(&metrics.rx_sizes, frame_len);
+
     if ( (device_type == IF_TUN && frame_len >= TUN_MIN_FRAME_SIZE) || (device_type == IF_TAP && frame_len >= ETHERNET_MIN_FRAME_SIZE) )  {
-        int written = write(attached_if, frame_buffer, frame_len);
+        capture_frame(link, CAPTURE_RX, frame, frame_len, CAPTURE_PASSED);
+        int written = write(attached_if, frame, frame_len);
         if (written == -1) {
-            if (verbose && !daemonize) printf("Could not write received KISS frame (%d bytes) to network interface, is the interface up?\r\n", frame_len);
+            METRIC_INC(if_write_errors);
+            LOG(LOG_INFO, "Could not write received KISS frame (%d bytes) to network interface, is the interface up?", frame_len);
         } else if (written != frame_len) {
+            METRIC_INC(if_short_writes);
             if (!daemonize) printf("Error: Could only write %d of %d bytes to interface", written, frame_len);
             cleanup();
             exit(1);
+        } else {
+            METRIC_INC(if_tx_frames);
+            METRIC_ADD(if_tx_bytes, written);
         }
-        if (verbose && !daemonize) printf("Got %d bytes from TNC, wrote %d bytes to interface\r\n", frame_len, written);
+        TRACE(if_write, frame_len, written);
+        LOG(LOG_DEBUG, "Got %d bytes from TNC, wrote %d bytes to interface", frame_len, written);
+    } else {
+        METRIC_INC(filter_undersized);
+        capture_frame(link, CAPTURE_RX, frame, frame_len, CAPTURE_UNDELIVERED);
     }
 }
 
-void kiss_serial_read(uint8_t sbyte) {
-    if (IN_FRAME && sbyte == FEND && kiss_command == CMD_DATA) {
-        IN_FRAME = false;
-        kiss_frame_received(frame_len);
-    } else if (sbyte == FEND) {
-        IN_FRAME = true;
-        kiss_command = CMD_UNKNOWN;
-        frame_len = 0;
-    } else if (IN_FRAME && frame_len < MAX_PAYLOAD) {
+// Called for every data frame from the TNC. In threaded
+// mode this runs on the main thread, after the frame
+// has crossed the pipeline ring. Copies of a frame
+// heard before are dropped, and striped frames from
+// bonded TNCs are put back in order.
+void kiss_frame_deliver(int link, uint8_t* frame, int frame_len) {
+    // Someone is using the channel
+    tnc_last_rx = metrics_now();
+
+    if (dedup_frames && dedup_seen(0, frame, frame_len, tnc_last_rx)) {
+        METRIC_INC(drops_duplicate[link]);
+        LOG(LOG_INFO, "Dropped duplicate of %d byte frame from TNC", frame_len);
+        return;
+    }
+
+    if (bond_striped) {
+        bond_reorder(link, frame, frame_len);
+    } else {
+        kiss_frame_output(link, frame, frame_len);
+    }
+}
+
+void kiss_frame_received(uint8_t* frame, int frame_len) {
+    if (threaded) {
+        pipeline_rx_push(frame, frame_len);
+    } else {
+        kiss_frame_deliver(0, frame, frame_len);
+    }
+}
+
+// Feeds one byte into a KISS decoder. Returns true
+// when a complete frame is available in the decoder
+// buffer, with its command and port nibbles set.
+bool kiss_decode(struct kiss_decoder* decoder, uint8_t sbyte) {
+    if (sbyte == FEND) {
+        bool complete = decoder->in_frame && decoder->command != CMD_UNKNOWN;
+        decoder->in_frame = true;
+        decoder->escape = false;
+        if (!complete) kiss_decoder_reset(decoder);
+        return complete;
+    } else if (decoder->in_frame) {
         // Have a look at the command byte first
-        if (frame_len == 0 && kiss_command == CMD_UNKNOWN) {
-            // Strip of port nibble
-            kiss_command = sbyte & 0x0F;
-        } else if (kiss_command == CMD_DATA) {
-            if (sbyte == FESC) {
-                ESCAPE = true;
+        if (decoder->command == CMD_UNKNOWN) {
+            // Strip off port nibble
+            decoder->command_byte = sbyte;
+            decoder->command = sbyte & 0x0F;
+            decoder->port = sbyte >> 4;
+            decoder->frame_len = 0;
+        } else if (sbyte == FESC) {
+            decoder->escape = true;
+            decoder->escapes++;
+        } else {
+            if (decoder->escape) {
+                if (sbyte == TFEND) sbyte = FEND;
+                if (sbyte == TFESC) sbyte = FESC;
+                decoder->escape = false;
+            }
+
+            if (decoder->frame_len < MAX_PAYLOAD) {
+                decoder->frame_buffer[decoder->frame_len++] = sbyte;
             } else {
-                if (ESCAPE) {
-                    if (sbyte == TFEND) sbyte = FEND;
-                    if (sbyte == TFESC) sbyte = FESC;
-                    ESCAPE = false;
-                }
+                decoder->truncated = true;
+            }
+        }
+    }
+    return false;
+}
+
+// Prepares a decoder for the next frame after a
+// completed frame has been consumed.
+void kiss_decoder_reset(struct kiss_decoder* decoder) {
+    decoder->command = CMD_UNKNOWN;
+    decoder->frame_len = 0;
+    decoder->escapes = 0;
+    decoder->truncated = false;
+}
+
+static void kiss_count_received(int link, int frame_len, int escapes, bool truncated) {
+    TRACE(kiss_decode, frame_len, escapes);
+    METRIC_INC(link[link].rx_frames);
+    METRIC_ADD(link[link].rx_bytes, frame_len);
+    if (escapes > 0) METRIC_ADD(link[link].rx_escapes, escapes);
+    if (truncated) METRIC_INC(link[link].rx_truncated);
+}
+
+// Frames that don't carry data are status reports,
+// which are passed on to the link telemetry. When
+// several ports are attached, data frames for ports
+// other than the first go to their own interface,
+// and are counted as links of their own. Frames for
+// ports that are not attached are dropped.
+static void kiss_decoded(int link, struct kiss_decoder* decoder) {
+    if (decoder->command == CMD_DATA && kiss_ports > 1 && decoder->port >= kiss_ports) {
+        METRIC_INC(filter_port);
+    } else if (decoder->command == CMD_DATA && kiss_ports > 1 && decoder->port != 0) {
+        kiss_count_received(decoder->port, decoder->frame_len, decoder->escapes, decoder->truncated);
+        tnc_last_rx = metrics_now();
+        if (dedup_frames && dedup_seen(decoder->port, decoder->frame_buffer, decoder->frame_len, tnc_last_rx)) {
+            METRIC_INC(drops_duplicate[decoder->port]);
+            LOG(LOG_INFO, "Dropped duplicate of %d byte frame from TNC port %d", decoder->frame_len, decoder->port);
+        } else {
+            ports_deliver(decoder->port, decoder->frame_buffer, decoder->frame_len);
+        }
+    } else if (decoder->command == CMD_DATA) {
+        kiss_count_received(link, decoder->frame_len, decoder->escapes, decoder->truncated);
+        telemetry_data_frame(link, decoder->frame_buffer, decoder->frame_len);
+        if (link == 0) {
+            kiss_frame_received(decoder->frame_buffer, decoder->frame_len);
+        } else {
+            kiss_frame_deliver(link, decoder->frame_buffer, decoder->frame_len);
+        }
+    } else {
+        telemetry_frame(link, decoder->command_byte, decoder->frame_buffer, decoder->frame_len);
+    }
+}
+
+void kiss_serial_read(uint8_t sbyte) {
+    if (kiss_decode(&tnc_decoder, sbyte)) {
+        kiss_decoded(0, &tnc_decoder);
+        kiss_decoder_reset(&tnc_decoder);
+    }
+}
+
+// Feeds a byte from a bonded TNC into its own decoder.
+// Bonded TNCs are read on the main thread, so their
+// frames are delivered directly.
+void kiss_link_read(int link, struct kiss_decoder* decoder, uint8_t sbyte) {
+    if (kiss_decode(decoder, sbyte)) {
+        kiss_decoded(link, decoder);
+        kiss_decoder_reset(decoder);
+    }
+}
+
+// Decodes a datagram carrying exactly one KISS frame.
+// Since the frame boundaries are already known, the
+// byte-wise state machine is skipped, and frames that
+// need no unescaping are passed on without copying.
+void kiss_datagram_read(uint8_t* buffer, int len) {
+    int start = 0;
+    while (start < len && buffer[start] == FEND) start++;
+    while (len > start && buffer[len-1] == FEND) len--;
+    if (start >= len) return;
+
+    uint8_t* payload = buffer+start+1;
+    int payload_len = len-start-1;
 
-                if (frame_len < MAX_PAYLOAD) {
-                    frame_buffer[frame_len++] = sbyte;
+    // Several frames in one datagram is not valid for
+    // datagram transports, but is handled gracefully
+    // by passing them through the stream decoder. Status
+    // reports are short and rare, and take the same way,
+    // as do frames for further ports.
+    bool other_port = kiss_ports > 1 && (buffer[start] >> 4) != 0;
+    if ((buffer[start] & 0x0F) != CMD_DATA || other_port || memchr(payload, FEND, payload_len) != NULL) {
+        tnc_decoder.in_frame = false;
+        kiss_serial_read(FEND);
+        for (int i = start; i < len; i++) kiss_serial_read(buffer[i]);
+        kiss_serial_read(FEND);
+        return;
+    }
+
+    // The payload limit applies to the unescaped frame,
+    // as in the stream decoder, so an escaped frame is
+    // only cut off once it has been unescaped
+    if (memchr(payload, FESC, payload_len) == NULL) {
+        bool truncated = payload_len > MAX_PAYLOAD;
+        if (truncated) payload_len = MAX_PAYLOAD;
+        kiss_count_received(0, payload_len, 0, truncated);
+        telemetry_data_frame(0, payload, payload_len);
+        kiss_frame_received(payload, payload_len);
+    } else {
+        int decoded_len = 0;
+        int escapes = 0;
+        bool escape = false;
+        bool truncated = false;
+        for (int i = 0; i < payload_len; i++) {
+            uint8_t byte = payload[i];
+            if (byte == FESC) {
+                escape = true;
+                escapes++;
+            } else {
+                if (escape) {
+                    if (byte == TFEND) byte = FEND;
+                    if (byte == TFESC) byte = FESC;
+                    escape = false;
+                }
+                if (decoded_len < MAX_PAYLOAD) {
+                    frame_buffer[decoded_len++] = byte;
+                } else {
+                    truncated = true;
                 }
             }
         }
+        kiss_count_received(0, decoded_len, escapes, truncated);
+        telemetry_data_frame(0, frame_buffer, decoded_len);
+        kiss_frame_received(frame_buffer, decoded_len);
     }
 }
 
-int kiss_write_frame(int serial_port, uint8_t* buffer, int frame_len) {
+// Frames and escapes a data frame into the output
+// buffer, which must hold at least frame_len*2+3
+// bytes. Returns the encoded length.
+int kiss_encode_frame(uint8_t* output, uint8_t* buffer, int frame_len) {
     int write_len = 0;
-    write_buffer[write_len++] = FEND;
-    write_buffer[write_len++] = CMD_DATA;
+    output[write_len++] = FEND;
+    output[write_len++] = CMD_DATA;
     for (int i = 0; i < frame_len; i++) {
         uint8_t byte = buffer[i];
         if (byte == FEND) {
-            write_buffer[write_len++] = FESC;
-            write_buffer[write_len++] = TFEND;
+            output[write_len++] = FESC;
+            output[write_len++] = TFEND;
         } else if (byte == FESC) {
-            write_buffer[write_len++] = FESC;
-            write_buffer[write_len++] = TFESC;
+            output[write_len++] = FESC;
+            output[write_len++] = TFESC;
         } else {
-            write_buffer[write_len++] = byte;
+            output[write_len++] = byte;
         }
     }
-    write_buffer[write_len++] = FEND;
+    output[write_len++] = FEND;
+
+    return write_len;
+}
+
+void kiss_encode_once(struct kiss_encoded* encoded, uint8_t* buffer, int frame_len) {
+    encoded->len = kiss_encode_frame(encoded->data, buffer, frame_len);
+    encoded->frame_len = frame_len;
+}
+
+static int kiss_count_written(int fd, int link, int written, int frame_len, int escapes) {
+    int write_errno = errno;
+    // Frames are queued by the kernel, so the time the
+    // frame leaves a serial port is estimated from
+    // what is left in the output queue.
+    if (TRACE_ACTIVE(tnc_write)) {
+        int queued = 0;
+        uint64_t completion = trace_now();
+        if (ioctl(fd, TIOCOUTQ, &queued) < 0) queued = 0;
+        if (baudrate > 0) completion += (uint64_t)queued*10*1000000000/baudrate;
+        TRACE_AT(tnc_write, frame_len, completion, queued);
+    }
+
+    // A TNC that is not taking data is not an error,
+    // and is left to the caller
+    if (written < 0) {
+        if (write_errno != EAGAIN) METRIC_INC(link[link].tx_errors);
+    } else {
+        METRIC_INC(link[link].tx_frames);
+        METRIC_ADD(link[link].tx_bytes, frame_len);
+        if (escapes > 0) METRIC_ADD(link[link].tx_escapes, escapes);
+    }
+    errno = write_errno;
+    return written;
+}
+
+static bool kiss_write_blocked(int fd) {
+    if (kiss_pending_len == 0 || fd != kiss_pending_fd) return false;
+    errno = EAGAIN;
+    return true;
+}
+
+// Deals with what a write left of the given buffers.
+// A nonblocking socket keeps the remainder for when
+// it is writable again. Writes to blocking serial
+// ports are only cut short by signals, and are
+// completed right away. Returns the bytes written by
+// the first write, or -1 if the rest could not be
+// written.
+static int kiss_finish_write(int fd, struct iovec* iov, int iovcnt, int written) {
+    int first = written;
+    bool nonblocking = false;
+    bool checked = false;
+    while (written >= 0) {
+        while (iovcnt > 0 && written >= (int)iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) return first;
+        iov->iov_base = (uint8_t*)iov->iov_base+written;
+        iov->iov_len -= written;
+
+        if (!checked) {
+            nonblocking = (fcntl(fd, F_GETFL) & O_NONBLOCK) != 0;
+            checked = true;
+        }
+        if (nonblocking) {
+            kiss_discard_pending(kiss_pending_fd);
+            for (int i = 0; i < iovcnt; i++) {
+                memcpy(kiss_pending+kiss_pending_len, iov[i].iov_base, iov[i].iov_len);
+                kiss_pending_len += iov[i].iov_len;
+            }
+            kiss_pending_fd = fd;
+            return first;
+        }
+
+        written = writev(fd, iov, iovcnt);
+        if (written < 0 && errno == EINTR) written = 0;
+    }
+    return -1;
+}
+
+// Writes out what is left of a partially written
+// frame. Returns the bytes that are still left, or
+// -1 if the TNC could not be written to.
+int kiss_write_pending(int fd) {
+    if (kiss_pending_len == 0 || fd != kiss_pending_fd) return 0;
+
+    int written = write(fd, kiss_pending+kiss_pending_offset, kiss_pending_len-kiss_pending_offset);
+    if (written < 0) return errno == EAGAIN ? kiss_pending_len-kiss_pending_offset : -1;
+    kiss_pending_offset += written;
+    if (kiss_pending_offset == kiss_pending_len) kiss_discard_pending(fd);
+    return kiss_pending_len-kiss_pending_offset;
+}
+
+bool kiss_has_pending(void) {
+    return kiss_pending_len > 0;
+}
+
+// Called whenever a TNC descriptor is closed, so that
+// a remainder is never written to another TNC that
+// is given the same descriptor
+void kiss_discard_pending(int fd) {
+    if (fd != kiss_pending_fd) return;
+    kiss_pending_len = 0;
+    kiss_pending_offset = 0;
+    kiss_pending_fd = -1;
+}
+
+// Counts a frame that was encoded beforehand and
+// written along with another one
+static void kiss_count_appended(int link, int written, struct kiss_encoded* appended) {
+    if (written < 0 || appended == NULL) return;
+    METRIC_INC(link[link].tx_frames);
+    METRIC_ADD(link[link].tx_bytes, appended->frame_len);
+}
+
+// Writes a data frame to the TNC without copying it.
+// The iovec list points at the unmodified runs of the
+// frame, with shared escape sequences spliced in where
+// needed. Frames with so many special bytes that the
+// list would not fit are encoded into write_buffer.
+// An encoded frame can be appended, which goes out in
+// the same write, so that the TNC sends both frames
+// with a single keyup. The frame is counted on the
+// given link, which is the port itself for frames to
+// further ports.
+static int kiss_write(int serial_port, int link, int port, uint8_t* buffer, int frame_len, struct kiss_encoded* appended) {
+    if (kiss_write_blocked(serial_port)) return kiss_count_written(serial_port, link, -1, frame_len, 0);
+
+    struct iovec iov[KISS_IOV_MAX];
+    int iovcnt = 0;
+    int run_start = 0;
+    int escapes = 0;
+    int reserved = appended != NULL ? 5 : 4;
+
+    iov[iovcnt].iov_base = frame_start[port];
+    iov[iovcnt++].iov_len = sizeof(frame_start[port]);
+    for (int i = 0; i < frame_len; i++) {
+        uint8_t byte = buffer[i];
+        if (byte != FEND && byte != FESC) continue;
+
+        // Leave room for this run and escape, as well
+        // as the last run and the closing FEND
+        if (iovcnt+reserved > KISS_IOV_MAX) {
+            int write_len = kiss_encode_frame(write_buffer, buffer, frame_len);
+            write_buffer[1] = frame_start[port][1];
+            TRACE(kiss_encode, frame_len, write_len-frame_len-3);
+            iov[0].iov_base = write_buffer;
+            iov[0].iov_len = write_len;
+            iovcnt = 1;
+            if (appended != NULL) {
+                iov[iovcnt].iov_base = appended->data;
+                iov[iovcnt++].iov_len = appended->len;
+            }
+            int written = kiss_finish_write(serial_port, iov, iovcnt, writev(serial_port, iov, iovcnt));
+            kiss_count_appended(link, written, appended);
+            return kiss_count_written(serial_port, link, written, frame_len, write_len-frame_len-3);
+        }
+
+        if (i > run_start) {
+            iov[iovcnt].iov_base = buffer+run_start;
+            iov[iovcnt++].iov_len = i-run_start;
+        }
+        iov[iovcnt].iov_base = byte == FEND ? escaped_fend : escaped_fesc;
+        iov[iovcnt++].iov_len = 2;
+        run_start = i+1;
+        escapes++;
+    }
+
+    if (frame_len > run_start) {
+        iov[iovcnt].iov_base = buffer+run_start;
+        iov[iovcnt++].iov_len = frame_len-run_start;
+    }
+    iov[iovcnt].iov_base = frame_end;
+    iov[iovcnt++].iov_len = sizeof(frame_end);
+    if (appended != NULL) {
+        iov[iovcnt].iov_base = appended->data;
+        iov[iovcnt++].iov_len = appended->len;
+    }
+
+    TRACE(kiss_encode, frame_len, escapes);
+    int written = kiss_finish_write(serial_port, iov, iovcnt, writev(serial_port, iov, iovcnt));
+    kiss_count_appended(link, written, appended);
+    return kiss_count_written(serial_port, link, written, frame_len, escapes);
+}
+
+int kiss_write_frame_appended(int serial_port, uint8_t* buffer, int frame_len, struct kiss_encoded* appended) {
+    return kiss_write(serial_port, 0, 0, buffer, frame_len, appended);
+}
+
+int kiss_write_frame(int serial_port, uint8_t* buffer, int frame_len) {
+    return kiss_write(serial_port, 0, 0, buffer, frame_len, NULL);
+}
+
+int kiss_write_link_frame(int serial_port, int link, uint8_t* buffer, int frame_len) {
+    return kiss_write(serial_port, link, 0, buffer, frame_len, NULL);
+}
+
+int kiss_write_port_frame(int serial_port, int port, uint8_t* buffer, int frame_len) {
+    return kiss_write(serial_port, port, port, buffer, frame_len, NULL);
+}
+
+int kiss_write_encoded(int serial_port, int link, struct kiss_encoded* encoded) {
+    if (kiss_write_blocked(serial_port)) return kiss_count_written(serial_port, link, -1, encoded->frame_len, 0);
 
-    return write(serial_port, write_buffer, write_len);
+    struct iovec iov = { .iov_base = encoded->data, .iov_len = encoded->len };
+    int written = kiss_finish_write(serial_port, &iov, 1, write(serial_port, encoded->data, encoded->len));
+    return kiss_count_written(serial_port, link, written, encoded->frame_len, 0);
 }
\ No newline at end of file
@@ -1,4 +1,8 @@
+#ifndef KISS_H
+#define KISS_H
+
 #include <stdint.h>
+#include <stdbool.h>
 #include "Constants.h"
 
 #define FEND 0xC0
@@ -15,7 +19,49 @@
 #define CMD_FULLDUPLEX 0x05
 #define CMD_SETHARDWARE 0x06
 
+// Status reports from RNode-class TNCs, which use the
+// whole command byte
+#define CMD_STAT_RSSI 0x23
+#define CMD_STAT_SNR 0x24
+#define CMD_STAT_CHTM 0x25
+
 #define MAX_PAYLOAD MTU_MAX
+#define KISS_IOV_MAX 64
+
+// A frame that is encoded once, and written to the
+// TNC as is any number of times
+struct kiss_encoded {
+    uint8_t data[MAX_PAYLOAD*2+3];
+    int len;
+    int frame_len;
+};
 
+struct kiss_decoder {
+    bool in_frame;
+    bool escape;
+    uint8_t command;
+    uint8_t port;
+    uint8_t command_byte;
+    int frame_len;
+    int escapes;
+    bool truncated;
+    uint8_t frame_buffer[MAX_PAYLOAD];
+};
+
+bool kiss_decode(struct kiss_decoder* decoder, uint8_t sbyte);
+void kiss_decoder_reset(struct kiss_decoder* decoder);
 void kiss_serial_read(uint8_t sbyte);
-int kiss_write_frame(int serial_port, uint8_t* buffer, int frame_len);
\ No newline at end of file
+void kiss_link_read(int link, struct kiss_decoder* decoder, uint8_t sbyte);
+void kiss_datagram_read(uint8_t* buffer, int len);
+int kiss_encode_frame(uint8_t* output, uint8_t* buffer, int frame_len);
+void kiss_encode_once(struct kiss_encoded* encoded, uint8_t* buffer, int frame_len);
+int kiss_write_frame(int serial_port, uint8_t* buffer, int frame_len);
+int kiss_write_frame_appended(int serial_port, uint8_t* buffer, int frame_len, struct kiss_encoded* appended);
+int kiss_write_link_frame(int serial_port, int link, uint8_t* buffer, int frame_len);
+int kiss_write_encoded(int serial_port, int link, struct kiss_encoded* encoded);
+int kiss_write_port_frame(int serial_port, int port, uint8_t* buffer, int frame_len);
+int kiss_write_pending(int fd);
+bool kiss_has_pending(void);
+void kiss_discard_pending(int fd);
+
+#endif
@@ -0,0 +1,222 @@
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "Log.h"
+#include "Timer.h"
+
+// Log statements in the data path only copy their
+// arguments into a ring, so a slow terminal or
+// syslog never holds up frames. Any thread may
+// append to the ring. Slots carry a sequence number
+// that tells whether a slot is free for the round
+// of the ring being written, or holds a record for
+// the round being read, so writers only contend on
+// the head index. The flusher thread formats and
+// writes the records. When the ring is full, records
+// are dropped and counted instead.
+//
+// While nothing is logged, the flusher thread sleeps
+// on an eventfd. Only the first record written after
+// it went to sleep rings the eventfd, and it then
+// waits LOG_FLUSH_INTERVAL to write out records in
+// batches, so busy logging costs at most one write
+// to the eventfd per interval.
+
+#define LOG_RATE_INTERVAL_NS ((uint64_t)LOG_RATE_INTERVAL*1000000000)
+
+int log_level = LOG_NOTICE;
+
+struct log_record log_ring[LOG_RING_SLOTS];
+_Atomic uint32_t log_head = 0;
+uint32_t log_tail = 0;
+_Atomic uint32_t log_dropped = 0;
+
+pthread_t log_thread;
+bool log_thread_running = false;
+_Atomic bool log_thread_stopping = false;
+_Atomic bool log_thread_sleeping = false;
+int log_efd = -1;
+
+extern bool verbose;
+extern bool daemonize;
+extern void cleanup(void);
+
+// Returns false when a statement has written all
+// the messages it may write in this interval, and
+// otherwise takes the count of those suppressed
+// since it last wrote one.
+static bool log_allowed(struct log_site* site, uint32_t* suppressed) {
+    *suppressed = 0;
+    if (site->priority > LOG_INFO) return true;
+
+    uint64_t window = timer_now()/LOG_RATE_INTERVAL_NS;
+    uint64_t current = atomic_load_explicit(&site->window, memory_order_relaxed);
+    if (current != window && atomic_compare_exchange_strong(&site->window, &current, window)) {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= LOG_RATE_BURST) {
+        atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    return true;
+}
+
+void log_write(struct log_site* site, int* args) {
+    uint32_t suppressed;
+    if (!log_allowed(site, &suppressed)) return;
+
+    uint32_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    struct log_record* record;
+    while (true) {
+        record = &log_ring[head % LOG_RING_SLOTS];
+        uint32_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        int32_t distance = (int32_t)(sequence-head);
+        if (distance == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &head, head+1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (distance < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            head = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    record->site = site;
+    record->suppressed = suppressed;
+    memcpy(record->args, args, sizeof(record->args));
+    atomic_store_explicit(&record->sequence, head+1, memory_order_release);
+
+    // Pairs with the fence in log_flusher, so that
+    // either the flusher sees this record before it
+    // sleeps, or this sees the flusher sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&log_thread_sleeping, memory_order_relaxed) &&
+        atomic_exchange_explicit(&log_thread_sleeping, false, memory_order_relaxed) && log_efd >= 0) {
+        uint64_t doorbell = 1;
+        ssize_t signalled = write(log_efd, &doorbell, sizeof(doorbell));
+        (void)signalled;
+    }
+}
+
+static bool log_ring_empty(void) {
+    struct log_record* record = &log_ring[log_tail % LOG_RING_SLOTS];
+    return atomic_load_explicit(&record->sequence, memory_order_acquire) != log_tail+1 &&
+           atomic_load_explicit(&log_dropped, memory_order_relaxed) == 0;
+}
+
+static void log_output(int priority, char* message) {
+    if (daemonize) {
+        syslog(priority, "%s", message);
+    } else {
+        printf("%s\r\n", message);
+    }
+}
+
+// Writes out all records in the ring. Called only
+// from the flusher thread, or after it has stopped.
+static void log_flush(void) {
+    char message[256];
+    bool flushed = false;
+
+    uint32_t dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        snprintf(message, sizeof(message), "Log ring full, dropped %u messages", dropped);
+        log_output(LOG_WARNING, message);
+        flushed = true;
+    }
+
+    while (true) {
+        struct log_record* record = &log_ring[log_tail % LOG_RING_SLOTS];
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != log_tail+1) break;
+
+        struct log_site* site = record->site;
+        int* args = record->args;
+        int len = snprintf(message, sizeof(message), site->format, args[0], args[1], args[2], args[3]);
+        if (record->suppressed > 0 && len >= 0 && len < (int)sizeof(message)) {
+            snprintf(message+len, sizeof(message)-len, " (%u similar messages suppressed)", record->suppressed);
+        }
+        int priority = site->priority;
+        atomic_store_explicit(&record->sequence, log_tail+LOG_RING_SLOTS, memory_order_release);
+        log_tail++;
+
+        log_output(priority, message);
+        flushed = true;
+    }
+
+    if (flushed && !daemonize) fflush(stdout);
+}
+
+// Signals are left to the main thread, which owns
+// all cleanup on exit.
+static void* log_flusher(void* arg) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = (long)LOG_FLUSH_INTERVAL*1000000 };
+    while (!atomic_load_explicit(&log_thread_stopping, memory_order_relaxed)) {
+        log_flush();
+
+        atomic_store_explicit(&log_thread_sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (log_ring_empty()) {
+            uint64_t doorbells;
+            while (read(log_efd, &doorbells, sizeof(doorbells)) < 0 && errno == EINTR);
+        }
+        atomic_store_explicit(&log_thread_sleeping, false, memory_order_relaxed);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+// Records may be written as soon as the ring is set
+// up, and wait there until the flusher thread starts
+void open_log(void) {
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++) atomic_init(&log_ring[i].sequence, i);
+    if (verbose) log_level = LOG_DEBUG;
+
+    // Unlike the pipeline eventfds, this one blocks,
+    // since only the flusher thread ever reads it
+    log_efd = eventfd(0, EFD_CLOEXEC);
+    if (log_efd < 0) {
+        perror("Could not create log eventfd");
+        cleanup();
+        exit(1);
+    }
+}
+
+// Like the pipeline threads, the flusher thread is
+// started after daemonizing
+void log_start(void) {
+    if (log_efd >= 0 && pthread_create(&log_thread, NULL, log_flusher, NULL) == 0) {
+        log_thread_running = true;
+    } else {
+        // Records are then written when the program
+        // exits, which is better than not at all
+        if (daemonize) {
+            syslog(LOG_ERR, "Could not start log thread");
+        } else {
+            printf("Error: Could not start log thread\r\n");
+        }
+    }
+}
+
+// Writes out whatever the flusher thread has not
+// got to yet
+void close_log(void) {
+    if (log_thread_running) {
+        atomic_store_explicit(&log_thread_stopping, true, memory_order_relaxed);
+        uint64_t doorbell = 1;
+        ssize_t signalled = write(log_efd, &doorbell, sizeof(doorbell));
+        (void)signalled;
+        pthread_join(log_thread, NULL);
+        log_thread_running = false;
+    }
+    log_flush();
+    if (log_efd >= 0) close(log_efd);
+    log_efd = -1;
+}
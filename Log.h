@@ -0,0 +1,64 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "Constants.h"
+
+// Log statements use the syslog priorities. Those
+// less important than LOG_MAX_LEVEL are compiled
+// out, and those less important than log_level are
+// skipped when the program runs.
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_MAX_ARGS 4
+
+// Every log statement has a site that holds its
+// format and its rate limit. Statements less
+// important than LOG_INFO are not rate limited.
+struct log_site {
+    const char* format;
+    int priority;
+    _Atomic uint64_t window;
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+};
+
+// A log statement as it waits in the ring for the
+// flusher thread. Arguments are copied, so formats
+// may only take integer arguments.
+struct log_record {
+    _Atomic uint32_t sequence;
+    struct log_site* site;
+    uint32_t suppressed;
+    int args[LOG_MAX_ARGS];
+};
+
+extern int log_level;
+
+// Appends a record to the ring and returns at once.
+// Formatting and writing the message is left to the
+// flusher thread. The format is checked against its
+// arguments by a printf call that is never made.
+#define LOG(level, message, ...) do { \
+    if ((level) <= LOG_MAX_LEVEL && __builtin_expect((level) <= log_level, 0)) { \
+        static struct log_site log_site = { .format = message, .priority = level }; \
+        if (0) printf(message, ##__VA_ARGS__); \
+        log_write(&log_site, (int[LOG_MAX_ARGS]){ __VA_ARGS__ }); \
+    } \
+} while (0)
+
+void log_write(struct log_site* site, int* args);
+void open_log(void);
+void log_start(void);
+void close_log(void);
+
+#endif
@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Metrics.h"
+#include "Timer.h"
+#include "Telemetry.h"
+#include "Priority.h"
+
+struct metrics metrics;
+
+int metrics_listen_fd = -1;
+char* metrics_socket_path = NULL;
+char* metrics_file_path = NULL;
+
+static void metrics_file_due(void);
+struct timer metrics_timer = { .callback = metrics_file_due };
+
+char metrics_text[METRICS_BUFFER_SIZE];
+
+extern bool daemonize;
+extern int bond_links;
+extern int kiss_ports;
+extern void cleanup(void);
+
+// Links are either bonded TNCs or KISS ports, and
+// the first link is the attached TNC or its first port
+int metrics_links(void) {
+    return kiss_ports > 1 ? kiss_ports : bond_links+1;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value) {
+    if (value < 2*HIST_SUB_BUCKETS) return value;
+
+    int magnitude = 63-__builtin_clzll(value);
+    int shift = magnitude-HIST_SUB_BITS;
+    int bucket = (shift+1)*HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS-1;
+}
+
+// Returns the smallest value counted in a bucket
+static uint64_t histogram_bucket_floor(int bucket) {
+    if (bucket < 2*HIST_SUB_BUCKETS) return bucket;
+
+    int shift = bucket/HIST_SUB_BUCKETS - 1;
+    return (uint64_t)(bucket%HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) << shift;
+}
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+    histogram->buckets[histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+static int text_len;
+
+static void text_append(const char* format, ...) {
+    if (text_len >= (int)sizeof(metrics_text)) return;
+
+    va_list args;
+    va_start(args, format);
+    text_len += vsnprintf(metrics_text+text_len, sizeof(metrics_text)-text_len, format, args);
+    va_end(args);
+}
+
+// Counters with several label sets share a name, and
+// are described only before the first of them.
+static void format_counter(const char* name, const char* help, const char* labels, uint64_t value) {
+    if (help != NULL) text_append("# HELP tncattach_%s %s\n# TYPE tncattach_%s counter\n", name, help, name);
+    text_append("tncattach_%s%s %llu\n", name, labels, (unsigned long long)value);
+}
+
+static void format_gauge(const char* name, const char* help, const char* labels, double value) {
+    if (help != NULL) text_append("# HELP tncattach_%s %s\n# TYPE tncattach_%s gauge\n", name, help, name);
+    text_append("tncattach_%s%s %g\n", name, labels, value);
+}
+
+// Link quality is only exported for links whose TNC
+// has sent status reports recently. Fields are given
+// by their offset, so that all samples of a metric
+// are written together.
+static void format_link_gauge(const char* name, const char* help, const char* window, size_t field, double scale) {
+    char labels[64];
+    for (int i = 0; i < TELEMETRY_MAX_LINKS; i++) {
+        if (!telemetry_current(i)) continue;
+        if (window != NULL) {
+            snprintf(labels, sizeof(labels), "{link=\"%d\",window=\"%s\"}", i, window);
+        } else {
+            snprintf(labels, sizeof(labels), "{link=\"%d\"}", i);
+        }
+        _Atomic int* value = (_Atomic int*)((uint8_t*)&telemetry[i]+field);
+        format_gauge(name, help, labels, *value*scale);
+        help = NULL;
+    }
+}
+
+static void format_source_labels(char* labels, size_t size, struct source_telemetry* source) {
+    uint8_t* mac = source->mac;
+    snprintf(labels, size, "{link=\"%d\",source=\"%02x:%02x:%02x:%02x:%02x:%02x\"}",
+        source->link, mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static void format_telemetry(void) {
+    char labels[64];
+    const char* help = "Status reports received from the TNC";
+    for (int i = 0; i < TELEMETRY_MAX_LINKS; i++) {
+        if (!telemetry_current(i)) continue;
+        snprintf(labels, sizeof(labels), "{link=\"%d\"}", i);
+        format_counter("tnc_status_frames_total", help, labels, telemetry[i].frames);
+        help = NULL;
+    }
+    format_link_gauge("tnc_rssi_dbm", "Signal strength of the last frame received by the TNC", NULL, offsetof(struct link_telemetry, rssi), 1);
+    format_link_gauge("tnc_snr_db", "Signal to noise ratio of the last frame received by the TNC", NULL, offsetof(struct link_telemetry, snr), 0.25);
+    format_link_gauge("tnc_noise_floor_dbm", "Noise floor reported by the TNC", NULL, offsetof(struct link_telemetry, noise_floor), 1);
+    format_link_gauge("tnc_airtime_ratio", "Share of time the TNC was transmitting", "short", offsetof(struct link_telemetry, airtime_short), 0.0001);
+    format_link_gauge("tnc_airtime_ratio", NULL, "long", offsetof(struct link_telemetry, airtime_long), 0.0001);
+    format_link_gauge("tnc_channel_load_ratio", "Share of time the channel was busy", "short", offsetof(struct link_telemetry, channel_load_short), 0.0001);
+    format_link_gauge("tnc_channel_load_ratio", NULL, "long", offsetof(struct link_telemetry, channel_load_long), 0.0001);
+
+    // Stations are only described once any are heard
+    pthread_mutex_lock(&telemetry_lock);
+    for (int i = 0; i < telemetry_source_count; i++) {
+        format_source_labels(labels, sizeof(labels), &telemetry_sources[i]);
+        format_counter("source_frames_total", i == 0 ? "Frames heard from a station with signal reports" : NULL, labels, telemetry_sources[i].frames);
+    }
+    for (int i = 0; i < telemetry_source_count; i++) {
+        format_source_labels(labels, sizeof(labels), &telemetry_sources[i]);
+        format_gauge("source_rssi_dbm", i == 0 ? "Signal strength of the last frame heard from a station" : NULL, labels, telemetry_sources[i].rssi);
+    }
+    for (int i = 0; i < telemetry_source_count; i++) {
+        format_source_labels(labels, sizeof(labels), &telemetry_sources[i]);
+        format_gauge("source_snr_db", i == 0 ? "Signal to noise ratio of the last frame heard from a station" : NULL, labels, telemetry_sources[i].snr/4.0);
+    }
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+// Writes a counter of every link, given by its
+// offset like the link quality gauges
+static void format_link_counter(const char* name, const char* help, size_t field) {
+    char labels[32];
+    for (int i = 0; i < metrics_links(); i++) {
+        snprintf(labels, sizeof(labels), "{link=\"%d\"}", i);
+        _Atomic uint64_t* value = (_Atomic uint64_t*)((uint8_t*)&metrics.link[i]+field);
+        format_counter(name, i == 0 ? help : NULL, labels, *value);
+    }
+}
+
+// Only buckets that have counted values are written,
+// which is valid since the buckets are cumulative.
+// Histograms take in the frames of all links.
+static void format_histogram(const char* name, const char* help, struct histogram* histogram) {
+    text_append("# HELP tncattach_%s %s\n# TYPE tncattach_%s histogram\n", name, help, name);
+
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HIST_BUCKETS-1; i++) {
+        if (histogram->buckets[i] == 0) continue;
+        cumulative += histogram->buckets[i];
+        text_append("tncattach_%s_bucket{le=\"%llu\"} %llu\n", name,
+            (unsigned long long)(histogram_bucket_floor(i+1)-1), (unsigned long long)cumulative);
+    }
+    text_append("tncattach_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)histogram->count);
+    text_append("tncattach_%s_sum %llu\n", name, (unsigned long long)histogram->sum);
+    text_append("tncattach_%s_count %llu\n", name, (unsigned long long)histogram->count);
+}
+
+// Renders all metrics in the Prometheus text format
+static int metrics_format(void) {
+    text_len = 0;
+
+    format_link_counter("tnc_tx_frames_total", "Frames written to the TNC", offsetof(struct link_metrics, tx_frames));
+    format_link_counter("tnc_tx_bytes_total", "Payload bytes written to the TNC", offsetof(struct link_metrics, tx_bytes));
+    format_link_counter("tnc_tx_escapes_total", "Bytes escaped when writing to the TNC", offsetof(struct link_metrics, tx_escapes));
+    format_link_counter("tnc_tx_errors_total", "Failed writes to the TNC", offsetof(struct link_metrics, tx_errors));
+    format_link_counter("tnc_rx_frames_total", "Data frames received from the TNC", offsetof(struct link_metrics, rx_frames));
+    format_link_counter("tnc_rx_bytes_total", "Payload bytes received from the TNC", offsetof(struct link_metrics, rx_bytes));
+    format_link_counter("tnc_rx_escapes_total", "Escaped bytes received from the TNC", offsetof(struct link_metrics, rx_escapes));
+    format_link_counter("tnc_rx_truncated_total", "Frames from the TNC truncated at the maximum payload size", offsetof(struct link_metrics, rx_truncated));
+
+    format_counter("if_rx_frames_total", "Frames read from the network interface", "", metrics.if_rx_frames);
+    format_counter("if_rx_bytes_total", "Bytes read from the network interface", "", metrics.if_rx_bytes);
+    format_counter("if_tx_frames_total", "Frames written to the network interface", "", metrics.if_tx_frames);
+    format_counter("if_tx_bytes_total", "Bytes written to the network interface", "", metrics.if_tx_bytes);
+    format_counter("if_write_errors_total", "Failed writes to the network interface", "", metrics.if_write_errors);
+    format_counter("if_short_writes_total", "Partial writes to the network interface", "", metrics.if_short_writes);
+
+    format_counter("filtered_frames_total", "Frames dropped by filters", "{reason=\"ipv6\"}", metrics.filter_ipv6);
+    format_counter("filtered_frames_total", NULL, "{reason=\"undersized\"}", metrics.filter_undersized);
+    format_counter("filtered_frames_total", NULL, "{reason=\"port\"}", metrics.filter_port);
+
+    format_counter("queue_drops_total", "Frames dropped by full queues", "{queue=\"outage\"}", metrics.drops_outage);
+    format_counter("queue_drops_total", NULL, "{queue=\"tnc\"}", metrics.drops_tnc_busy);
+    format_counter("queue_drops_total", NULL, "{queue=\"pipeline\"}", metrics.drops_pipeline);
+    format_counter("queue_drops_total", NULL, "{queue=\"shm\"}", metrics.drops_shm);
+    format_counter("queue_drops_total", NULL, "{queue=\"server\"}", metrics.drops_server);
+    format_counter("queue_drops_total", NULL, "{queue=\"pool\"}", metrics.drops_pool);
+    format_counter("queue_drops_total", NULL, "{queue=\"interactive\"}", metrics.drops_priority[PRIORITY_INTERACTIVE]);
+    format_counter("queue_drops_total", NULL, "{queue=\"normal\"}", metrics.drops_priority[PRIORITY_NORMAL]);
+    format_counter("queue_drops_total", NULL, "{queue=\"bulk\"}", metrics.drops_priority[PRIORITY_BULK]);
+
+    char labels[32];
+    for (int i = 0; i < metrics_links(); i++) {
+        snprintf(labels, sizeof(labels), "{link=\"%d\"}", i);
+        format_counter("tnc_rx_duplicates_total", i == 0 ? "Duplicate frames from the TNC that were dropped" : NULL, labels, metrics.drops_duplicate[i]);
+    }
+
+    format_telemetry();
+
+    format_histogram("tx_latency_microseconds", "Time from reading a frame from the interface to writing it to the TNC", &metrics.tx_latency);
+    format_histogram("tx_frame_bytes", "Sizes of frames written to the TNC", &metrics.tx_sizes);
+    format_histogram("rx_frame_bytes", "Sizes of data frames received from the TNC", &metrics.rx_sizes);
+
+    if (text_len > (int)sizeof(metrics_text)-1) text_len = sizeof(metrics_text)-1;
+    return text_len;
+}
+
+static void metrics_write_file(void) {
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics_file_path);
+
+    // Scrapers must never see a half written file,
+    // so it is replaced atomically by renaming.
+    FILE* file = fopen(tmp_path, "w");
+    if (file == NULL) return;
+    int len = metrics_format();
+    bool written = fwrite(metrics_text, 1, len, file) == (size_t)len;
+    if (fclose(file) != 0) written = false;
+
+    if (!written || rename(tmp_path, metrics_file_path) < 0) {
+        unlink(tmp_path);
+        if (daemonize) {
+            syslog(LOG_ERR, "Could not write metrics file %s", metrics_file_path);
+        } else {
+            printf("Error: Could not write metrics file %s\r\n", metrics_file_path);
+        }
+    }
+}
+
+// The metrics file is written right away on startup,
+// and then at a fixed interval
+static void metrics_file_due(void) {
+    timer_arm(&metrics_timer, METRICS_FILE_INTERVAL*1000);
+    metrics_write_file();
+}
+
+// Either the control socket path or the file path
+// may be NULL, disabling that way of reading metrics.
+void open_metrics(char* socket_path, char* file_path) {
+    if (socket_path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            printf("Error: Metrics socket path %s is too long\r\n", socket_path);
+            cleanup();
+            exit(1);
+        }
+        strcpy(addr.sun_path, socket_path);
+
+        metrics_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (metrics_listen_fd < 0) {
+            perror("Could not open metrics socket");
+            cleanup();
+            exit(1);
+        }
+
+        unlink(socket_path);
+        if (bind(metrics_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(metrics_listen_fd, 4) < 0) {
+            perror("Could not bind metrics socket");
+            cleanup();
+            exit(1);
+        }
+        metrics_socket_path = socket_path;
+    }
+
+    if (file_path != NULL) {
+        metrics_file_path = file_path;
+        timer_arm(&metrics_timer, 0);
+    }
+}
+
+void close_metrics(void) {
+    if (metrics_listen_fd >= 0) close(metrics_listen_fd);
+    if (metrics_socket_path != NULL) unlink(metrics_socket_path);
+    metrics_listen_fd = -1;
+    metrics_socket_path = NULL;
+    metrics_file_path = NULL;
+}
+
+int metrics_poll_fds(struct pollfd* fds) {
+    if (metrics_listen_fd < 0) return 0;
+    fds[0].fd = metrics_listen_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return 1;
+}
+
+// Every connection to the control socket receives
+// a snapshot of all metrics, and is then closed.
+void metrics_poll_events(struct pollfd* fds, int n_fds) {
+    if (n_fds < 1 || !(fds[0].revents & POLLIN)) return;
+
+    int fd = accept4(metrics_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    int len = metrics_format();
+    ssize_t written = send(fd, metrics_text, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    (void)written;
+    close(fd);
+}
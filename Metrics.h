@@ -0,0 +1,87 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "Constants.h"
+
+#define METRICS_MAX_FDS 1
+
+// Histograms are log-linear, like HDR histograms.
+// Values below 2*HIST_SUB_BUCKETS get a bucket each,
+// and every following power of two is split into
+// HIST_SUB_BUCKETS buckets of equal width.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 256
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+// Counters for traffic to and from one TNC, or one
+// port of a multi-port TNC. They are updated from
+// the reader threads as well, so all counters are
+// atomic.
+struct link_metrics {
+    _Atomic uint64_t tx_frames;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint64_t tx_escapes;
+    _Atomic uint64_t tx_errors;
+    _Atomic uint64_t rx_frames;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint64_t rx_escapes;
+    _Atomic uint64_t rx_truncated;
+};
+
+struct metrics {
+    struct link_metrics link[TNC_MAX_LINKS];
+    _Atomic uint64_t if_rx_frames;
+    _Atomic uint64_t if_rx_bytes;
+    _Atomic uint64_t if_tx_frames;
+    _Atomic uint64_t if_tx_bytes;
+    _Atomic uint64_t if_write_errors;
+    _Atomic uint64_t if_short_writes;
+    _Atomic uint64_t filter_ipv6;
+    _Atomic uint64_t filter_undersized;
+    _Atomic uint64_t filter_port;
+    _Atomic uint64_t drops_outage;
+    _Atomic uint64_t drops_tnc_busy;
+    _Atomic uint64_t drops_pipeline;
+    _Atomic uint64_t drops_shm;
+    _Atomic uint64_t drops_server;
+    _Atomic uint64_t drops_pool;
+    _Atomic uint64_t drops_priority[PRIORITY_CLASSES];
+    _Atomic uint64_t drops_duplicate[TNC_MAX_LINKS];
+
+    // Histograms are only updated on the main thread
+    struct histogram tx_latency;
+    struct histogram tx_sizes;
+    struct histogram rx_sizes;
+};
+
+extern struct metrics metrics;
+
+// Relaxed atomic adds are cheap enough to keep the
+// counters enabled at all times.
+#define METRIC_ADD(counter, n) atomic_fetch_add_explicit(&metrics.counter, (n), memory_order_relaxed)
+#define METRIC_INC(counter) METRIC_ADD(counter, 1)
+
+int metrics_links(void);
+uint64_t metrics_now(void);
+void histogram_record(struct histogram* histogram, uint64_t value);
+
+void open_metrics(char* socket_path, char* file_path);
+void close_metrics(void);
+int metrics_poll_fds(struct pollfd* fds);
+void metrics_poll_events(struct pollfd* fds, int n_fds);
+
+#endif
@@ -0,0 +1,124 @@
+#include <syslog.h>
+#include "Netlink.h"
+
+extern bool daemonize;
+
+// Requests are laid out back to back in the batch
+// buffer, and are always built one at a time, so the
+// request being built is the last one in the buffer.
+
+void nl_batch_init(struct nl_batch* batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+static void* nl_batch_reserve(struct nl_batch* batch, int len) {
+    if (batch->len+NLMSG_ALIGN(len) > NETLINK_BATCH_SIZE) {
+        printf("Error: Netlink batch is too large\r\n");
+        exit(1);
+    }
+    void* data = batch->buffer+batch->len;
+    memset(data, 0, NLMSG_ALIGN(len));
+    batch->len += NLMSG_ALIGN(len);
+    return data;
+}
+
+struct nlmsghdr* nl_batch_msg(struct nl_batch* batch, int type, int flags, const char* what, bool optional) {
+    if (batch->n_msgs == NETLINK_BATCH_MSGS) {
+        printf("Error: Too many requests in netlink batch\r\n");
+        exit(1);
+    }
+
+    struct nlmsghdr* msg = nl_batch_reserve(batch, sizeof(struct nlmsghdr));
+    msg->nlmsg_len = NLMSG_HDRLEN;
+    msg->nlmsg_type = type;
+    msg->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    msg->nlmsg_seq = batch->n_msgs+1;
+    batch->what[batch->n_msgs] = what;
+    batch->optional[batch->n_msgs] = optional;
+    batch->n_msgs++;
+    return msg;
+}
+
+void* nl_msg_put(struct nl_batch* batch, struct nlmsghdr* msg, const void* data, int len) {
+    void* payload = nl_batch_reserve(batch, len);
+    memcpy(payload, data, len);
+    msg->nlmsg_len = (uint8_t*)batch->buffer+batch->len-(uint8_t*)msg;
+    return payload;
+}
+
+struct rtattr* nl_attr_put(struct nl_batch* batch, struct nlmsghdr* msg, int type, const void* data, int len) {
+    struct rtattr* attr = nl_batch_reserve(batch, RTA_LENGTH(len));
+    attr->rta_type = type;
+    attr->rta_len = RTA_LENGTH(len);
+    if (len > 0) memcpy(RTA_DATA(attr), data, len);
+    msg->nlmsg_len = (uint8_t*)batch->buffer+batch->len-(uint8_t*)msg;
+    return attr;
+}
+
+struct rtattr* nl_attr_nest(struct nl_batch* batch, struct nlmsghdr* msg, int type) {
+    return nl_attr_put(batch, msg, type | NLA_F_NESTED, NULL, 0);
+}
+
+void nl_attr_nest_end(struct nl_batch* batch, struct rtattr* nest) {
+    nest->rta_len = (uint8_t*)batch->buffer+batch->len-(uint8_t*)nest;
+}
+
+// Sends the whole batch in one go, and waits for every
+// request to be acknowledged. The kernel handles the
+// requests in order, and carries on after a failed
+// one, so all failures are reported. Returns false if
+// any request that is not optional failed.
+bool nl_batch_run(struct nl_batch* batch) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        perror("Could not open netlink socket");
+        return false;
+    }
+
+    // Acknowledgements don't need to carry a copy of
+    // the failed request
+    int one = 1;
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(fd, batch->buffer, batch->len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) != batch->len) {
+        perror("Could not send netlink requests");
+        close(fd);
+        return false;
+    }
+
+    bool success = true;
+    int acked = 0;
+    uint8_t reply[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    while (acked < batch->n_msgs) {
+        ssize_t len = recv(fd, reply, sizeof(reply), 0);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("Could not receive netlink acknowledgements");
+            success = false;
+            break;
+        }
+
+        for (struct nlmsghdr* msg = (struct nlmsghdr*)reply; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            if (msg->nlmsg_type != NLMSG_ERROR) continue;
+            if (msg->nlmsg_seq < 1 || msg->nlmsg_seq > (uint32_t)batch->n_msgs) continue;
+
+            struct nlmsgerr* err = NLMSG_DATA(msg);
+            int index = msg->nlmsg_seq-1;
+            acked++;
+            if (err->error != 0 && !batch->optional[index]) {
+                if (daemonize) {
+                    syslog(LOG_ERR, "Could not %s: %s", batch->what[index], strerror(-err->error));
+                } else {
+                    printf("Error: Could not %s: %s\r\n", batch->what[index], strerror(-err->error));
+                }
+                success = false;
+            }
+        }
+    }
+
+    close(fd);
+    return success;
+}
@@ -0,0 +1,36 @@
+#ifndef NETLINK_H
+#define NETLINK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "Constants.h"
+
+// A batch of rtnetlink requests, sent to the kernel
+// in a single message and acknowledged one by one.
+// Each request carries a description for reporting
+// errors, and optional requests may fail silently.
+struct nl_batch {
+    uint8_t buffer[NETLINK_BATCH_SIZE] __attribute__((aligned(NLMSG_ALIGNTO)));
+    int len;
+    int n_msgs;
+    const char* what[NETLINK_BATCH_MSGS];
+    bool optional[NETLINK_BATCH_MSGS];
+};
+
+void nl_batch_init(struct nl_batch* batch);
+struct nlmsghdr* nl_batch_msg(struct nl_batch* batch, int type, int flags, const char* what, bool optional);
+void* nl_msg_put(struct nl_batch* batch, struct nlmsghdr* msg, const void* data, int len);
+struct rtattr* nl_attr_put(struct nl_batch* batch, struct nlmsghdr* msg, int type, const void* data, int len);
+struct rtattr* nl_attr_nest(struct nl_batch* batch, struct nlmsghdr* msg, int type);
+void nl_attr_nest_end(struct nl_batch* batch, struct rtattr* nest);
+bool nl_batch_run(struct nl_batch* batch);
+
+#endif
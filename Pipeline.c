@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "Pipeline.h"
+#include "KISS.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Replay.h"
+
+// One TX ring per interface queue. The rings share
+// the eventfd of the first one.
+struct pipeline_ring* tx_rings[IF_MAX_QUEUES];
+int n_tx_rings = 0;
+struct pipeline_ring* rx_ring = NULL;
+
+pthread_t if_threads[IF_MAX_QUEUES];
+pthread_t tnc_thread;
+bool tnc_thread_running = false;
+_Atomic bool tnc_thread_stopping = false;
+int tnc_thread_cpu = -1;
+
+uint8_t pipeline_if_buffers[IF_MAX_QUEUES][MTU_MAX];
+uint8_t pipeline_tnc_buffer[MAX_PAYLOAD*2+3];
+
+extern bool daemonize;
+extern bool noipv6;
+extern bool kiss_over_datagram;
+extern bool kiss_over_udp;
+extern int attached_tnc;
+extern int tap_queue_fds[];
+extern int tap_queues;
+extern int device_type;
+extern void cleanup();
+extern bool is_ipv6(uint8_t* frame);
+extern void tnc_transmit(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+extern void tnc_read_failed(void);
+extern void if_read_failed(void);
+extern void kiss_frame_deliver(int link, uint8_t* frame, int frame_len);
+
+// Creates a ring with its own eventfd, or sharing
+// the one given
+static struct pipeline_ring* ring_create(int efd) {
+    struct pipeline_ring* ring = aligned_alloc(64, sizeof(struct pipeline_ring));
+    if (ring == NULL) {
+        printf("Error: Could not allocate pipeline ring\r\n");
+        cleanup();
+        exit(1);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->efd = efd >= 0 ? efd : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->efd < 0) {
+        perror("Could not create pipeline eventfd");
+        cleanup();
+        exit(1);
+    }
+    return ring;
+}
+
+// Called only from the producing thread. Frames are
+// dropped when the ring is full, in the same way the
+// kernel drops frames when the interface queue is.
+static bool ring_push(struct pipeline_ring* ring, uint8_t* data, int len, uint64_t read_time) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head-tail >= PIPELINE_RING_SLOTS) {
+        METRIC_INC(drops_pipeline);
+        return false;
+    }
+
+    struct pipeline_slot* slot = &ring->slots[head % PIPELINE_RING_SLOTS];
+    if (len > 0) memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->read_time = read_time;
+    atomic_store_explicit(&ring->head, head+1, memory_order_release);
+
+    // The eventfd counter can only overflow if the
+    // main thread is gone, so failures are ignored.
+    uint64_t doorbell = 1;
+    ssize_t signalled = write(ring->efd, &doorbell, sizeof(doorbell));
+    (void)signalled;
+    return true;
+}
+
+static void pin_thread(pthread_t thread, int cpu) {
+    if (cpu < 0) return;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset) != 0) {
+        if (daemonize) {
+            syslog(LOG_ERR, "Could not pin pipeline thread to CPU %d", cpu);
+        } else {
+            printf("Error: Could not pin pipeline thread to CPU %d\r\n", cpu);
+        }
+    }
+}
+
+// Signals are left to the main thread, which owns
+// all cleanup on exit.
+static void block_signals(void) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void* if_reader(void* arg) {
+    block_signals();
+    int queue = (int)(intptr_t)arg;
+    int fd = tap_queue_fds[queue];
+    struct pipeline_ring* ring = tx_rings[queue];
+    uint8_t* buffer = pipeline_if_buffers[queue];
+    int min_frame_size = device_type == IF_TAP ? ETHERNET_MIN_FRAME_SIZE : TUN_MIN_FRAME_SIZE;
+    while (true) {
+        int if_len = read(fd, buffer, MTU_MAX);
+        if (if_len > 0) {
+            record_read(REPLAY_SOURCE_IF, buffer, if_len);
+            uint64_t read_time = metrics_now();
+            METRIC_INC(if_rx_frames);
+            METRIC_ADD(if_rx_bytes, if_len);
+            TRACE_AT(if_read, if_len, read_time, 0);
+            if (if_len >= min_frame_size) {
+                if (!noipv6 || (noipv6 && !is_ipv6(buffer))) {
+                    TRACE(filter, if_len, 1);
+                    ring_push(ring, buffer, if_len, read_time);
+                } else {
+                    METRIC_INC(filter_ipv6);
+                    TRACE(filter, if_len, 0);
+                    capture_frame(0, CAPTURE_TX, buffer, if_len, CAPTURE_FILTERED);
+                }
+            } else {
+                METRIC_INC(filter_undersized);
+                TRACE(filter, if_len, 0);
+            }
+        } else {
+            if (if_len < 0 && errno == EINTR) continue;
+            ring_push(ring, NULL, if_len < 0 ? -errno : -1, 0);
+            return NULL;
+        }
+    }
+}
+
+static void* tnc_reader(void* arg) {
+    block_signals();
+    while (true) {
+        int tnc_len = read(attached_tnc, pipeline_tnc_buffer, sizeof(pipeline_tnc_buffer));
+        if (tnc_len > 0) {
+            record_read(REPLAY_SOURCE_TNC, pipeline_tnc_buffer, tnc_len);
+            if (kiss_over_datagram) {
+                kiss_datagram_read(pipeline_tnc_buffer, tnc_len);
+            } else {
+                for (int i = 0; i < tnc_len; i++) {
+                    kiss_serial_read(pipeline_tnc_buffer[i]);
+                }
+            }
+        } else {
+            if (tnc_len < 0 && errno == EINTR) continue;
+
+            // TCP sockets are nonblocking, and are waited
+            // for here. Shutting the socket down wakes the
+            // wait up as well.
+            if (tnc_len < 0 && errno == EAGAIN) {
+                struct pollfd readable = { .fd = attached_tnc, .events = POLLIN };
+                poll(&readable, 1, -1);
+                continue;
+            }
+
+            // Datagram peers may come and go, and an
+            // empty UDP datagram is not an error.
+            if (kiss_over_datagram && (kiss_over_udp || (tnc_len < 0 && errno == ECONNREFUSED))) continue;
+
+            // A reader stopped by the main thread exits
+            // quietly, since the failure is already known.
+            if (!atomic_load(&tnc_thread_stopping)) {
+                while (!ring_push(rx_ring, NULL, tnc_len < 0 ? -errno : -1, 0)) usleep(1000);
+            }
+            return NULL;
+        }
+    }
+}
+
+// Called by the decoder on the TNC reader thread
+bool pipeline_rx_push(uint8_t* frame, int frame_len) {
+    bool pushed = ring_push(rx_ring, frame, frame_len, 0);
+    if (!pushed) LOG(LOG_INFO, "Pipeline RX ring full, dropped %d byte frame", frame_len);
+    return pushed;
+}
+
+void pipeline_start_tnc_reader(void) {
+    if (tnc_thread_running || attached_tnc < 0) return;
+
+    atomic_store(&tnc_thread_stopping, false);
+    if (pthread_create(&tnc_thread, NULL, tnc_reader, NULL) != 0) {
+        perror("Could not start TNC reader thread");
+        cleanup();
+        exit(1);
+    }
+    pin_thread(tnc_thread, tnc_thread_cpu);
+    tnc_thread_running = true;
+}
+
+// Stops the TNC reader before its descriptor is
+// closed. Sockets are shut down to wake up a reader
+// blocked in read, which then exits on its own.
+void pipeline_stop_tnc_reader(void) {
+    if (!tnc_thread_running) return;
+
+    atomic_store(&tnc_thread_stopping, true);
+    if (shutdown(attached_tnc, SHUT_RDWR) < 0) pthread_cancel(tnc_thread);
+    pthread_join(tnc_thread, NULL);
+    tnc_thread_running = false;
+}
+
+// Every interface queue gets a reader thread, pinned
+// to consecutive cores starting at the given one.
+void pipeline_start(int if_cpu, int tnc_cpu) {
+    n_tx_rings = tap_queues;
+    for (int i = 0; i < n_tx_rings; i++) {
+        tx_rings[i] = ring_create(i == 0 ? -1 : tx_rings[0]->efd);
+    }
+    rx_ring = ring_create(-1);
+    tnc_thread_cpu = tnc_cpu;
+
+    for (int i = 0; i < n_tx_rings; i++) {
+        if (pthread_create(&if_threads[i], NULL, if_reader, (void*)(intptr_t)i) != 0) {
+            perror("Could not start interface reader thread");
+            cleanup();
+            exit(1);
+        }
+        pin_thread(if_threads[i], if_cpu < 0 ? -1 : if_cpu+i);
+    }
+    pipeline_start_tnc_reader();
+}
+
+int pipeline_poll_fds(struct pollfd* fds) {
+    fds[0].fd = tx_rings[0]->efd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = rx_ring->efd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    return PIPELINE_MAX_FDS;
+}
+
+// Handles the oldest slot in a ring, and returns
+// false if the ring was empty.
+static bool ring_drain_one(struct pipeline_ring* ring, bool tx) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return false;
+
+    struct pipeline_slot* slot = &ring->slots[tail % PIPELINE_RING_SLOTS];
+    if (tx) {
+        if (slot->len < 0) if_read_failed();
+        tnc_transmit(0, slot->data, slot->len, slot->read_time);
+    } else {
+        if (slot->len < 0) {
+            // Ignore failures of a reader that the main
+            // thread has already stopped by itself.
+            if (tnc_thread_running) {
+                tnc_thread_running = false;
+                pthread_join(tnc_thread, NULL);
+                tnc_read_failed();
+            }
+        } else {
+            kiss_frame_deliver(0, slot->data, slot->len);
+        }
+    }
+    atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+    return true;
+}
+
+static bool ring_doorbell(struct pipeline_ring* ring) {
+    uint64_t doorbell;
+    return read(ring->efd, &doorbell, sizeof(doorbell)) >= 0 || errno == EAGAIN;
+}
+
+// The interface queues are drained a frame at a time
+// in turn, so that the flows on one queue can't hold
+// back the flows on the others.
+static void tx_rings_drain(void) {
+    if (!ring_doorbell(tx_rings[0])) return;
+
+    bool drained = false;
+    while (!drained) {
+        drained = true;
+        for (int i = 0; i < n_tx_rings; i++) {
+            if (ring_drain_one(tx_rings[i], true)) drained = false;
+        }
+    }
+}
+
+static void rx_ring_drain(void) {
+    if (!ring_doorbell(rx_ring)) return;
+    while (ring_drain_one(rx_ring, false));
+}
+
+// Runs the writers on the main thread, so that a slow
+// serial write never delays reading from the TNC.
+void pipeline_poll_events(struct pollfd* fds, int n_fds) {
+    if (fds[0].revents & POLLIN) tx_rings_drain();
+    if (fds[1].revents & POLLIN) rx_ring_drain();
+}
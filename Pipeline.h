@@ -0,0 +1,43 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include "Constants.h"
+
+#define PIPELINE_MAX_FDS 2
+
+// A negative slot length signals that the reader
+// thread failed, and carries the errno of the read.
+struct pipeline_slot {
+    int len;
+    uint64_t read_time;
+    uint8_t data[MTU_MAX];
+};
+
+// Single-producer, single-consumer frame ring. The
+// reader thread produces, and the main thread, which
+// owns all writers, consumes after the eventfd fires.
+struct pipeline_ring {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    int efd;
+    struct pipeline_slot slots[PIPELINE_RING_SLOTS];
+};
+
+void pipeline_start(int if_cpu, int tnc_cpu);
+void pipeline_start_tnc_reader(void);
+void pipeline_stop_tnc_reader(void);
+bool pipeline_rx_push(uint8_t* frame, int frame_len);
+int pipeline_poll_fds(struct pollfd* fds);
+void pipeline_poll_events(struct pollfd* fds, int n_fds);
+
+#endif
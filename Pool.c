@@ -0,0 +1,83 @@
+#include <time.h>
+#include "Pool.h"
+#include "Metrics.h"
+#include "Log.h"
+
+struct frame* pool_frames = NULL;
+uint8_t* pool_buffers = NULL;
+struct frame* pool_free_list = NULL;
+int pool_size = 0;
+int pool_available = 0;
+
+extern void cleanup(void);
+
+// Allocates all frame buffers up front. The pool
+// never grows, so once running, queueing frames
+// takes no heap allocations at all.
+void open_pool(int n_frames) {
+    pool_frames = calloc(n_frames, sizeof(struct frame));
+    pool_buffers = aligned_alloc(64, (size_t)n_frames*FRAME_BUFFER_SIZE);
+    if (pool_frames == NULL || pool_buffers == NULL) {
+        printf("Error: Could not allocate frame pool\r\n");
+        cleanup();
+        exit(1);
+    }
+
+    for (int i = n_frames-1; i >= 0; i--) {
+        pool_frames[i].data = pool_buffers+(size_t)i*FRAME_BUFFER_SIZE;
+        pool_frames[i].next_free = pool_free_list;
+        pool_free_list = &pool_frames[i];
+    }
+    pool_size = n_frames;
+    pool_available = n_frames;
+}
+
+void close_pool(void) {
+    free(pool_frames);
+    free(pool_buffers);
+    pool_frames = NULL;
+    pool_buffers = NULL;
+    pool_free_list = NULL;
+    pool_size = 0;
+    pool_available = 0;
+}
+
+// Returns a frame with a single reference, or NULL
+// if the pool is exhausted, in which case the caller
+// drops the frame like a full queue would.
+struct frame* frame_alloc(void) {
+    struct frame* frame = pool_free_list;
+    if (frame == NULL) {
+        METRIC_INC(drops_pool);
+        LOG(LOG_INFO, "Frame pool exhausted, dropping frame");
+        return NULL;
+    }
+    pool_free_list = frame->next_free;
+    pool_available--;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    frame->refcount = 1;
+    frame->len = 0;
+    frame->timestamp = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+    frame->flow_hash = 0;
+    frame->link_id = 0;
+    frame->next_free = NULL;
+    return frame;
+}
+
+struct frame* frame_ref(struct frame* frame) {
+    frame->refcount++;
+    return frame;
+}
+
+void frame_release(struct frame* frame) {
+    if (--frame->refcount > 0) return;
+    frame->next_free = pool_free_list;
+    pool_free_list = frame;
+    pool_available++;
+}
+
+int frame_pool_available(void) {
+    return pool_available;
+}
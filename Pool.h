@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "Constants.h"
+#include "KISS.h"
+
+// Buffers are large enough for a fully escaped
+// KISS frame, and padded to whole cache lines.
+#define FRAME_BUFFER_SIZE (((MAX_PAYLOAD*2+3)+63) & ~63)
+
+// A pooled frame, shared by reference between the
+// queues holding it, and returned to the pool by
+// the last of them.
+struct frame {
+    int refcount;
+    int len;
+    uint64_t timestamp;
+    uint32_t flow_hash;
+    int link_id;
+    struct frame* next_free;
+    uint8_t* data;
+};
+
+void open_pool(int n_frames);
+void close_pool(void);
+struct frame* frame_alloc(void);
+struct frame* frame_ref(struct frame* frame);
+void frame_release(struct frame* frame);
+int frame_pool_available(void);
+
+#endif
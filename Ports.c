@@ -0,0 +1,138 @@
+#include <syslog.h>
+#include "Ports.h"
+#include "TAP.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Capture.h"
+
+// A multi-port TNC carries several radio ports over
+// one connection, telling them apart by the high
+// nibble of the command byte. The first port is
+// handled like the TNC of a single-port setup, and
+// every further port gets an interface of its own,
+// which is read and written on the main thread.
+
+int kiss_ports = 1;
+int port_ifs[KISS_MAX_PORTS];
+int ports_opened = 1;
+char port_if_names[KISS_MAX_PORTS][IFNAMSIZ];
+
+// Identification is sent on every port that has
+// transmitted since the last one, each with its own
+// copy of the frame tagged with the port
+bool port_tx_since_id[KISS_MAX_PORTS];
+struct kiss_encoded port_id_frames[KISS_MAX_PORTS];
+
+uint8_t port_buffer[MTU_MAX];
+
+extern bool daemonize;
+extern bool noipv6;
+extern int attached_tnc;
+extern int attached_if;
+extern int device_type;
+extern int id_interval;
+extern char* id;
+extern struct kiss_encoded id_frame;
+extern void cleanup(void);
+extern bool is_ipv6(uint8_t* frame);
+extern void tnc_transmit(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+
+void open_ports(void) {
+    port_ifs[0] = attached_if;
+    for (int port = 1; port < kiss_ports; port++) {
+        port_ifs[port] = open_tap_port(port, port_if_names[port]);
+        ports_opened++;
+        printf("TNC port %d configured as %s\r\n", port, port_if_names[port]);
+
+        if (id_interval != -1) {
+            port_id_frames[port] = id_frame;
+            port_id_frames[port].data[1] = port << 4 | CMD_DATA;
+        }
+    }
+}
+
+void close_ports(void) {
+    for (int port = 1; port < ports_opened; port++) close(port_ifs[port]);
+    ports_opened = 1;
+}
+
+// Writes a data frame received on a further port to
+// its interface
+void ports_deliver(int port, uint8_t* frame, int frame_len) {
+    if ( (device_type == IF_TUN && frame_len >= TUN_MIN_FRAME_SIZE) || (device_type == IF_TAP && frame_len >= ETHERNET_MIN_FRAME_SIZE) )  {
+        capture_frame(port, CAPTURE_RX, frame, frame_len, CAPTURE_PASSED);
+        int written = write(port_ifs[port], frame, frame_len);
+        if (written == frame_len) {
+            METRIC_INC(if_tx_frames);
+            METRIC_ADD(if_tx_bytes, written);
+        } else {
+            METRIC_INC(if_write_errors);
+        }
+        LOG(LOG_DEBUG, "Got %d bytes from TNC port %d, wrote %d bytes to its interface", frame_len, port, written);
+    } else {
+        METRIC_INC(filter_undersized);
+        capture_frame(port, CAPTURE_RX, frame, frame_len, CAPTURE_UNDELIVERED);
+    }
+}
+
+static void port_frame_read(int port, uint8_t* frame, int frame_len) {
+    int min_frame_size = device_type == IF_TAP ? ETHERNET_MIN_FRAME_SIZE : TUN_MIN_FRAME_SIZE;
+    METRIC_INC(if_rx_frames);
+    METRIC_ADD(if_rx_bytes, frame_len);
+    if (frame_len < min_frame_size) {
+        METRIC_INC(filter_undersized);
+    } else if (noipv6 && is_ipv6(frame)) {
+        METRIC_INC(filter_ipv6);
+        capture_frame(port, CAPTURE_TX, frame, frame_len, CAPTURE_FILTERED);
+    } else {
+        tnc_transmit(port, frame, frame_len, metrics_now());
+    }
+}
+
+void ports_transmit_id(void) {
+    for (int port = 0; port < kiss_ports; port++) {
+        if (!port_tx_since_id[port]) continue;
+        if (kiss_write_encoded(attached_tnc, port, port == 0 ? &id_frame : &port_id_frames[port]) < 0) continue;
+        port_tx_since_id[port] = false;
+    }
+}
+
+int ports_poll_fds(struct pollfd* fds) {
+    for (int port = 1; port < kiss_ports; port++) {
+        fds[port-1].fd = port_ifs[port];
+        fds[port-1].events = POLLIN;
+        fds[port-1].revents = 0;
+    }
+    return kiss_ports-1;
+}
+
+void ports_poll_events(struct pollfd* fds, int n_fds) {
+    for (int port = 1; port <= n_fds; port++) {
+        short revents = fds[port-1].revents;
+        if (revents == 0) continue;
+
+        if (revents & (POLLHUP | POLLERR)) {
+            if (daemonize) {
+                syslog(LOG_ERR, "Received error event from %s", port_if_names[port]);
+            } else {
+                printf("Error: Received error event from %s\r\n", port_if_names[port]);
+            }
+            cleanup();
+            exit(1);
+        }
+
+        if (revents & POLLIN) {
+            int len = read(port_ifs[port], port_buffer, sizeof(port_buffer));
+            if (len <= 0) {
+                if (daemonize) {
+                    syslog(LOG_ERR, "Could not read from %s, exiting now", port_if_names[port]);
+                } else {
+                    printf("Error: Could not read from %s, exiting now\r\n", port_if_names[port]);
+                }
+                cleanup();
+                exit(1);
+            }
+            port_frame_read(port, port_buffer, len);
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef PORTS_H
+#define PORTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include "Constants.h"
+#include "KISS.h"
+
+#define PORTS_MAX_FDS (KISS_MAX_PORTS-1)
+
+extern int kiss_ports;
+extern bool port_tx_since_id[KISS_MAX_PORTS];
+
+void open_ports(void);
+void close_ports(void);
+void ports_deliver(int port, uint8_t* frame, int frame_len);
+void ports_transmit_id(void);
+int ports_poll_fds(struct pollfd* fds);
+void ports_poll_events(struct pollfd* fds, int n_fds);
+
+#endif
@@ -0,0 +1,237 @@
+#include <sys/ioctl.h>
+#include "Priority.h"
+#include "Pool.h"
+#include "TCP.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Timer.h"
+
+// Frames for the TNC are sorted into classes by the
+// DSCP field of IPv4 and IPv6 packets, or by the
+// priority code point of VLAN tagged Ethernet frames,
+// and held in a queue per class. They are only handed
+// to the TNC while its output queue is nearly empty,
+// so a frame in a higher class never waits behind
+// more than a few bytes of bulk traffic. Interactive
+// frames are always sent first, and normal frames are
+// weighted against bulk frames, so bulk traffic is
+// slowed down but never starved.
+//
+// Since interactive frames are never held back for
+// the other classes, only the DSCP values for network
+// control, expedited forwarding, voice admit,
+// signalling and OAM are interactive, as are ARP and
+// VLAN priorities from 3 upwards. Lower effort and
+// CS1 traffic, and VLAN priority 1, are bulk.
+// Everything else, including the low-latency data
+// classes, is normal.
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_IPV6 0x86DD
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+
+#define DSCP_LE 1
+#define DSCP_CS1 8
+#define DSCP_CS2 16
+#define DSCP_CS5 40
+#define DSCP_VOICE_ADMIT 44
+#define DSCP_EF 46
+#define DSCP_CS6 48
+#define DSCP_CS7 56
+#define PCP_BACKGROUND 1
+#define PCP_CRITICAL 3
+
+struct priority_queue {
+    struct frame* frames[PRIORITY_QUEUE_MAX];
+    int head;
+    int count;
+};
+
+struct priority_queue priority_queues[PRIORITY_CLASSES];
+int priority_limits[PRIORITY_CLASSES] = { PRIORITY_QUEUE_INTERACTIVE, PRIORITY_QUEUE_NORMAL, PRIORITY_QUEUE_BULK };
+int normal_credit = PRIORITY_NORMAL_WEIGHT;
+
+// The bit rate of the channel, when it is given, and
+// the time at which the TNC is expected to have sent
+// all frames handed to it
+int air_rate = 0;
+uint64_t air_busy_until = 0;
+
+// Runs when the output queue of the TNC is expected
+// to have drained
+static void priority_drain(void);
+struct timer priority_timer = { .callback = priority_drain };
+
+extern bool kiss_over_tcp;
+extern int attached_tnc;
+extern int baudrate;
+extern int device_type;
+extern int tcp_state;
+extern void tnc_send(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+
+static int dscp_class(int dscp) {
+    switch (dscp) {
+        case DSCP_CS2:
+        case DSCP_CS5:
+        case DSCP_VOICE_ADMIT:
+        case DSCP_EF:
+        case DSCP_CS6:
+        case DSCP_CS7:
+            return PRIORITY_INTERACTIVE;
+        case DSCP_LE:
+        case DSCP_CS1:
+            return PRIORITY_BULK;
+        default:
+            return PRIORITY_NORMAL;
+    }
+}
+
+int priority_class(uint8_t* frame, int frame_len) {
+    int offset;
+    int ethertype;
+    if (device_type == IF_TAP) {
+        if (frame_len < ETHERNET_MIN_FRAME_SIZE) return PRIORITY_NORMAL;
+        ethertype = frame[12] << 8 | frame[13];
+        offset = ETHERNET_MIN_FRAME_SIZE;
+
+        if (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) {
+            if (frame_len < offset+2) return PRIORITY_NORMAL;
+            int pcp = frame[offset] >> 5;
+            if (pcp >= PCP_CRITICAL) return PRIORITY_INTERACTIVE;
+            if (pcp == PCP_BACKGROUND) return PRIORITY_BULK;
+            return PRIORITY_NORMAL;
+        }
+        if (ethertype == ETHERTYPE_ARP) return PRIORITY_INTERACTIVE;
+    } else {
+        // Skip the packet information header
+        if (frame_len < TUN_MIN_FRAME_SIZE) return PRIORITY_NORMAL;
+        ethertype = frame[2] << 8 | frame[3];
+        offset = 4;
+    }
+
+    uint8_t* ip = frame+offset;
+    if (frame_len < offset+2) return PRIORITY_NORMAL;
+    if (ethertype == ETHERTYPE_IPV4 && ip[0] >> 4 == 4) return dscp_class(ip[1] >> 2);
+    if (ethertype == ETHERTYPE_IPV6 && ip[0] >> 4 == 6) return dscp_class((ip[0] & 0x0F) << 2 | ip[1] >> 6);
+    return PRIORITY_NORMAL;
+}
+
+// Picks the class to send from next, or returns -1
+// when all queues are empty
+static int priority_next(void) {
+    bool normal = priority_queues[PRIORITY_NORMAL].count > 0;
+    bool bulk = priority_queues[PRIORITY_BULK].count > 0;
+
+    if (priority_queues[PRIORITY_INTERACTIVE].count > 0) return PRIORITY_INTERACTIVE;
+    if (normal && (!bulk || normal_credit > 0)) {
+        if (bulk) normal_credit--;
+        return PRIORITY_NORMAL;
+    }
+    if (bulk) {
+        normal_credit = PRIORITY_NORMAL_WEIGHT;
+        return PRIORITY_BULK;
+    }
+    return -1;
+}
+
+static bool priority_queued(void) {
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        if (priority_queues[i].count > 0) return true;
+    }
+    return false;
+}
+
+static uint64_t air_time(int bytes) {
+    return (uint64_t)bytes*8*1000000000/air_rate;
+}
+
+// Hands frames to the TNC until its output queue has
+// filled up, and then waits for as long as it takes
+// the TNC to drain it. The output queue is only that
+// of the serial port or socket, which a TNC with a
+// buffer of its own drains at the line rate, long
+// before the frames are sent on air. When the air
+// rate is given, frames are also held while the TNC
+// is expected to have more than the allowed backlog
+// left to send. Without it, classes are only kept
+// apart within the output queue. While the TNC is
+// not reachable, frames are passed on at once, and
+// handled by the outage policy.
+static void priority_drain(void) {
+    while (priority_queued()) {
+        bool reachable = attached_tnc >= 0 && !(kiss_over_tcp && tcp_state != TCP_CONNECTED);
+        int delay = 0;
+        int backlog = 0;
+        if (reachable && ioctl(attached_tnc, TIOCOUTQ, &backlog) < 0) backlog = 0;
+        if (backlog >= PRIORITY_TNC_BACKLOG) {
+            delay = PRIORITY_POLL_INTERVAL;
+            if (baudrate > 0) delay = (backlog-PRIORITY_TNC_BACKLOG)*10*1000/baudrate+1;
+        }
+
+        uint64_t now = timer_now();
+        uint64_t allowed = air_rate > 0 ? now+air_time(PRIORITY_TNC_BACKLOG) : 0;
+        if (reachable && air_rate > 0 && air_busy_until > allowed) {
+            int air_delay = (air_busy_until-allowed)/1000000+1;
+            if (air_delay > delay) delay = air_delay;
+        }
+        if (delay > 0) {
+            timer_arm(&priority_timer, delay);
+            return;
+        }
+
+        struct priority_queue* queue = &priority_queues[priority_next()];
+        struct frame* queued = queue->frames[queue->head];
+        queue->head = (queue->head+1) % PRIORITY_QUEUE_MAX;
+        queue->count--;
+        if (reachable && air_rate > 0) {
+            if (air_busy_until < now) air_busy_until = now;
+            air_busy_until += air_time(queued->len);
+        }
+        tnc_send(queued->link_id, queued->data, queued->len, queued->timestamp);
+        frame_release(queued);
+    }
+}
+
+// Frames arriving while the TNC is busy wait for the
+// drain timer, which is already armed. Frames of all
+// ports share the classes, since they share the TNC.
+void priority_enqueue(int port, uint8_t* frame, int frame_len, uint64_t read_time) {
+    int class = priority_class(frame, frame_len);
+    struct priority_queue* queue = &priority_queues[class];
+    if (queue->count == priority_limits[class]) {
+        METRIC_INC(drops_priority[class]);
+        LOG(LOG_INFO, "Priority class %d is full, dropped %d byte frame", class, frame_len);
+        return;
+    }
+
+    // The pool holds enough frames for every class to
+    // be full, unless other queues have taken them
+    struct frame* queued = frame_alloc();
+    if (queued == NULL) {
+        METRIC_INC(drops_priority[class]);
+        LOG(LOG_INFO, "No frame left for priority class %d, dropped %d byte frame", class, frame_len);
+        return;
+    }
+    memcpy(queued->data, frame, frame_len);
+    queued->len = frame_len;
+    queued->timestamp = read_time;
+    queued->link_id = port;
+    queue->frames[(queue->head+queue->count) % PRIORITY_QUEUE_MAX] = queued;
+    queue->count++;
+
+    if (!priority_timer.armed) priority_drain();
+}
+
+void close_priority(void) {
+    timer_cancel(&priority_timer);
+    for (int i = 0; i < PRIORITY_CLASSES; i++) {
+        struct priority_queue* queue = &priority_queues[i];
+        while (queue->count > 0) {
+            frame_release(queue->frames[queue->head]);
+            queue->head = (queue->head+1) % PRIORITY_QUEUE_MAX;
+            queue->count--;
+        }
+    }
+}
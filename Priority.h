@@ -0,0 +1,23 @@
+#ifndef PRIORITY_H
+#define PRIORITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "Constants.h"
+
+#define PRIORITY_INTERACTIVE 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_BULK 2
+
+extern int priority_limits[PRIORITY_CLASSES];
+extern int air_rate;
+
+int priority_class(uint8_t* frame, int frame_len);
+void priority_enqueue(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+void close_priority(void);
+
+#endif
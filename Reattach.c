@@ -0,0 +1,214 @@
+#include <syslog.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include "Reattach.h"
+#include "Serial.h"
+#include "KISS.h"
+#include "Pipeline.h"
+#include "Bond.h"
+#include "Ports.h"
+#include "Pool.h"
+#include "Metrics.h"
+#include "Log.h"
+#include "Timer.h"
+#include "Capture.h"
+
+// Frames sent to the interface while the TNC is gone
+// are dropped, or held in a small queue until it is
+// back. Held frames that have grown too old to be of
+// any use are aged out when the queue is flushed.
+struct frame* outage_queue[OUTAGE_QUEUE_LEN];
+int outage_queue_head = 0;
+int outage_queue_count = 0;
+
+// A serial TNC that disappears, as USB adapters do
+// when the TNC resets, is waited for by watching its
+// directory for the device node to reappear. Opening
+// is also retried periodically, since udev may only
+// make the node accessible some time after creating
+// it, or create the directory itself with the node.
+static void serial_reattach(void);
+bool serial_detached = false;
+struct timer serial_timer = { .callback = serial_reattach };
+int reattach_inotify_fd = -1;
+int reattach_watch = -1;
+
+extern bool daemonize;
+extern bool threaded;
+extern int attached_tnc;
+extern int baudrate;
+extern int outage_policy;
+extern char* serial_port_path;
+extern void tnc_link_lost(void);
+extern void id_after_tx(void);
+
+void outage_enqueue(int port, uint8_t* frame, int frame_len, uint64_t read_time) {
+    if (outage_policy != OUTAGE_BUFFER) {
+        METRIC_INC(drops_outage);
+        LOG(LOG_INFO, "TNC not connected, dropped %d byte frame", frame_len);
+        return;
+    }
+
+    // When full, the oldest frame is aged out
+    if (outage_queue_count == OUTAGE_QUEUE_LEN) {
+        frame_release(outage_queue[outage_queue_head]);
+        METRIC_INC(drops_outage);
+        outage_queue_head = (outage_queue_head+1) % OUTAGE_QUEUE_LEN;
+        outage_queue_count--;
+    }
+
+    struct frame* queued = frame_alloc();
+    if (queued == NULL) return;
+    memcpy(queued->data, frame, frame_len);
+    queued->len = frame_len;
+    queued->timestamp = read_time != 0 ? read_time : metrics_now();
+    queued->link_id = port;
+
+    int slot = (outage_queue_head+outage_queue_count) % OUTAGE_QUEUE_LEN;
+    outage_queue[slot] = queued;
+    outage_queue_count++;
+}
+
+// Called once the TNC, or any bonded TNC, is usable
+// again
+void outage_flush(void) {
+    uint64_t now = metrics_now();
+    while (outage_queue_count > 0 && (bond_links > 0 ? bond_available() : attached_tnc >= 0)) {
+        struct frame* queued = outage_queue[outage_queue_head];
+        outage_queue_head = (outage_queue_head+1) % OUTAGE_QUEUE_LEN;
+        outage_queue_count--;
+
+        if (now-queued->timestamp > (uint64_t)OUTAGE_MAX_AGE*1000000000) {
+            METRIC_INC(drops_outage);
+            frame_release(queued);
+            continue;
+        }
+
+        int written;
+        if (bond_links > 0) {
+            written = bond_transmit(queued->data, queued->len);
+        } else {
+            written = kiss_write_port_frame(attached_tnc, queued->link_id, queued->data, queued->len);
+        }
+
+        // A TCP TNC that has stopped taking data gets the
+        // frame again once it is writable
+        if (written < 0 && errno == EAGAIN && bond_links == 0) {
+            outage_queue_head = (outage_queue_head+OUTAGE_QUEUE_LEN-1) % OUTAGE_QUEUE_LEN;
+            outage_queue[outage_queue_head] = queued;
+            outage_queue_count++;
+            break;
+        }
+        if (written >= 0) {
+            if (bond_links == 0) capture_frame(queued->link_id, CAPTURE_TX, queued->data, queued->len, CAPTURE_PASSED);
+            port_tx_since_id[queued->link_id] = true;
+            id_after_tx();
+            histogram_record(&metrics.tx_sizes, queued->len);
+            histogram_record(&metrics.tx_latency, (metrics_now()-queued->timestamp)/1000);
+        }
+        frame_release(queued);
+        if (written < 0 && bond_links == 0) tnc_link_lost();
+    }
+}
+
+static void reattach_watch_directory(void) {
+    if (reattach_inotify_fd < 0) {
+        reattach_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (reattach_inotify_fd < 0) return;
+    }
+
+    if (reattach_watch < 0) {
+        char directory[PATH_MAX];
+        strncpy(directory, serial_port_path, sizeof(directory)-1);
+        directory[sizeof(directory)-1] = 0;
+        reattach_watch = inotify_add_watch(reattach_inotify_fd, dirname(directory), IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    }
+}
+
+static void reattach_unwatch_directory(void) {
+    if (reattach_watch >= 0) inotify_rm_watch(reattach_inotify_fd, reattach_watch);
+    reattach_watch = -1;
+}
+
+// Called when the serial port hangs up or fails. The
+// port is closed and the network interface is left
+// untouched until the TNC is back.
+void serial_link_lost(void) {
+    if (serial_detached) return;
+
+    if (daemonize) {
+        syslog(LOG_ERR, "Lost connection to TNC, waiting for %s to reappear", serial_port_path);
+    } else {
+        printf("Lost connection to TNC, waiting for %s to reappear\r\n", serial_port_path);
+    }
+
+    if (threaded) pipeline_stop_tnc_reader();
+    close_port(attached_tnc);
+    kiss_discard_pending(attached_tnc);
+    attached_tnc = -1;
+    serial_detached = true;
+    timer_arm(&serial_timer, SERIAL_REATTACH_INTERVAL);
+    reattach_watch_directory();
+}
+
+static void serial_reattach(void) {
+    timer_arm(&serial_timer, SERIAL_REATTACH_INTERVAL);
+    reattach_watch_directory();
+
+    int fd = open(serial_port_path, O_RDWR | O_NOCTTY | O_SYNC | O_NDELAY | O_CLOEXEC);
+    if (fd < 0) return;
+    fcntl(fd, F_SETFL, 0);
+    if (!setup_port(fd, baudrate)) {
+        close_port(fd);
+        return;
+    }
+
+    attached_tnc = fd;
+    serial_detached = false;
+    timer_cancel(&serial_timer);
+    reattach_unwatch_directory();
+
+    if (daemonize) {
+        syslog(LOG_NOTICE, "Reattached TNC at %s", serial_port_path);
+    } else {
+        printf("Reattached TNC at %s\r\n", serial_port_path);
+    }
+
+    if (threaded) pipeline_start_tnc_reader();
+    outage_flush();
+}
+
+int reattach_poll_fds(struct pollfd* fds) {
+    fds[0].fd = serial_detached ? reattach_inotify_fd : -1;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return REATTACH_MAX_FDS;
+}
+
+// Any change in the watched directory triggers an
+// attempt right away, since udev may create the node
+// under a temporary name before renaming it.
+void reattach_poll_events(struct pollfd* fds, int n_fds) {
+    if (!(fds[0].revents & POLLIN)) return;
+
+    uint8_t events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(reattach_inotify_fd, events, sizeof(events)) > 0);
+
+    // The directory itself may be gone, and is
+    // watched again on the next attempt
+    reattach_unwatch_directory();
+    if (serial_detached) serial_reattach();
+}
+
+void close_reattach(void) {
+    if (reattach_inotify_fd >= 0) close(reattach_inotify_fd);
+    reattach_inotify_fd = -1;
+    reattach_watch = -1;
+
+    while (outage_queue_count > 0) {
+        frame_release(outage_queue[outage_queue_head]);
+        outage_queue_head = (outage_queue_head+1) % OUTAGE_QUEUE_LEN;
+        outage_queue_count--;
+    }
+}
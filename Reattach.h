@@ -0,0 +1,28 @@
+#ifndef REATTACH_H
+#define REATTACH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include "Constants.h"
+
+#define OUTAGE_DROP 0
+#define OUTAGE_BUFFER 1
+
+#define REATTACH_MAX_FDS 1
+
+void outage_enqueue(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+void outage_flush(void);
+
+void serial_link_lost(void);
+int reattach_poll_fds(struct pollfd* fds);
+void reattach_poll_events(struct pollfd* fds, int n_fds);
+void close_reattach(void);
+
+#endif
@@ -0,0 +1,162 @@
+#include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "Replay.h"
+#include "KISS.h"
+#include "Metrics.h"
+
+// Reads from the TNC and the interface are recorded
+// as they were returned by read, so partial reads,
+// escapes split across reads and line noise are all
+// preserved. Replaying a recording feeds the same
+// chunks through the decoder and the transmit path,
+// with the TNC replaced by /dev/null.
+
+int recording_fd = -1;
+uint64_t recording_start = 0;
+
+FILE* replay_file = NULL;
+char* replay_path = NULL;
+uint8_t replay_buffer[UINT16_MAX];
+
+extern bool daemonize;
+extern bool kiss_over_datagram;
+extern int device_type;
+extern int mtu;
+extern void cleanup(void);
+extern void if_frame_read(uint8_t* frame, int frame_len);
+
+void open_recording(char* path) {
+    recording_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (recording_fd < 0) {
+        printf("Error: Could not open recording file %s\r\n", path);
+        cleanup();
+        exit(1);
+    }
+
+    struct replay_header header;
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_VERSION;
+    header.flags = 0;
+    if (kiss_over_datagram) header.flags |= REPLAY_FLAG_DATAGRAM;
+    if (device_type == IF_TAP) header.flags |= REPLAY_FLAG_TAP;
+    header.mtu = mtu;
+    if (write(recording_fd, &header, sizeof(header)) != sizeof(header)) {
+        printf("Error: Could not write recording file %s\r\n", path);
+        cleanup();
+        exit(1);
+    }
+    recording_start = metrics_now();
+}
+
+void close_recording(void) {
+    if (recording_fd < 0) return;
+    close(recording_fd);
+    recording_fd = -1;
+}
+
+// Called from the main thread and from the reader
+// threads. Each record is written in one unbuffered
+// append, which keeps it whole when threads record
+// at the same time, and leaves nothing to be lost if
+// tncattach is killed.
+void record_read(int source, uint8_t* data, int len) {
+    if (recording_fd < 0 || len <= 0) return;
+
+    struct replay_record record;
+    record.time = metrics_now()-recording_start;
+    record.len = len;
+    record.source = source;
+    record.reserved = 0;
+
+    struct iovec iov[2] = { { &record, sizeof(record) }, { data, len } };
+    ssize_t written = writev(recording_fd, iov, 2);
+    (void)written;
+}
+
+// Opens a recording before the interface is created,
+// which is then set up like the recorded one was.
+void open_replay(char* path) {
+    replay_file = fopen(path, "r");
+    if (replay_file == NULL) {
+        printf("Error: Could not open recording file %s\r\n", path);
+        exit(1);
+    }
+
+    struct replay_header header;
+    if (fread(&header, sizeof(header), 1, replay_file) != 1 || memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: %s is not a tncattach recording\r\n", path);
+        exit(1);
+    }
+    if (header.version != REPLAY_VERSION) {
+        printf("Error: Unsupported recording version %d in %s\r\n", header.version, path);
+        exit(1);
+    }
+
+    replay_path = path;
+    kiss_over_datagram = header.flags & REPLAY_FLAG_DATAGRAM;
+    device_type = header.flags & REPLAY_FLAG_TAP ? IF_TAP : IF_TUN;
+    if (header.mtu >= MTU_MIN && header.mtu <= MTU_MAX) mtu = header.mtu;
+}
+
+static void wait_until(uint64_t time) {
+    struct timespec ts;
+    ts.tv_sec = time / 1000000000;
+    ts.tv_nsec = time % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// Replays the whole recording, either as fast as
+// possible, or paced with the recorded timestamps.
+void run_replay(bool paced) {
+    uint64_t counts[2] = { 0, 0 };
+    uint64_t bytes[2] = { 0, 0 };
+    uint64_t start = metrics_now();
+    uint64_t first_time = 0;
+    struct replay_record record;
+
+    while (fread(&record, sizeof(record), 1, replay_file) == 1) {
+        if (record.source > REPLAY_SOURCE_IF || fread(replay_buffer, 1, record.len, replay_file) != record.len) {
+            if (daemonize) {
+                syslog(LOG_ERR, "Recording %s is truncated or corrupt, replay stopped", replay_path);
+            } else {
+                printf("Error: Recording %s is truncated or corrupt, replay stopped\r\n", replay_path);
+            }
+            break;
+        }
+        // Time spent waiting for the first read is skipped
+        if (counts[REPLAY_SOURCE_TNC]+counts[REPLAY_SOURCE_IF] == 0) first_time = record.time;
+        if (paced) wait_until(start+record.time-first_time);
+
+        if (record.source == REPLAY_SOURCE_TNC) {
+            if (kiss_over_datagram) {
+                kiss_datagram_read(replay_buffer, record.len);
+            } else {
+                for (int i = 0; i < record.len; i++) {
+                    kiss_serial_read(replay_buffer[i]);
+                }
+            }
+        } else {
+            if_frame_read(replay_buffer, record.len);
+        }
+        counts[record.source]++;
+        bytes[record.source] += record.len;
+    }
+
+    double elapsed = (metrics_now()-start)/1e9;
+    uint64_t total = bytes[REPLAY_SOURCE_TNC]+bytes[REPLAY_SOURCE_IF];
+    if (daemonize) {
+        syslog(LOG_NOTICE, "Replayed %llu TNC reads (%llu bytes) and %llu interface reads (%llu bytes) in %.6f seconds",
+            (unsigned long long)counts[REPLAY_SOURCE_TNC], (unsigned long long)bytes[REPLAY_SOURCE_TNC],
+            (unsigned long long)counts[REPLAY_SOURCE_IF], (unsigned long long)bytes[REPLAY_SOURCE_IF], elapsed);
+    } else {
+        printf("Replayed %llu TNC reads (%llu bytes) and %llu interface reads (%llu bytes) in %.6f seconds, %.2f MB/s\r\n",
+            (unsigned long long)counts[REPLAY_SOURCE_TNC], (unsigned long long)bytes[REPLAY_SOURCE_TNC],
+            (unsigned long long)counts[REPLAY_SOURCE_IF], (unsigned long long)bytes[REPLAY_SOURCE_IF], elapsed,
+            elapsed > 0 ? total/elapsed/1e6 : 0);
+    }
+    fclose(replay_file);
+    replay_file = NULL;
+}
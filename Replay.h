@@ -0,0 +1,46 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "Constants.h"
+
+// Recordings start with a file header, followed by
+// one record per read, each made up of a record
+// header and the bytes exactly as they were read.
+// All fields are in host byte order.
+#define REPLAY_MAGIC "TNCR"
+#define REPLAY_VERSION 1
+
+#define REPLAY_FLAG_DATAGRAM 0x01
+#define REPLAY_FLAG_TAP 0x02
+
+#define REPLAY_SOURCE_TNC 0
+#define REPLAY_SOURCE_IF 1
+
+struct replay_header {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint16_t mtu;
+} __attribute__((packed));
+
+struct replay_record {
+    uint64_t time;
+    uint16_t len;
+    uint8_t source;
+    uint8_t reserved;
+} __attribute__((packed));
+
+void open_recording(char* path);
+void close_recording(void);
+void record_read(int source, uint8_t* data, int len);
+
+void open_replay(char* path);
+void run_replay(bool paced);
+
+#endif
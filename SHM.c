@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "SHM.h"
+#include "Metrics.h"
+#include "Log.h"
+
+int shm_listen_fd = -1;
+int shm_conn_fd = -1;
+int shm_mem_fd = -1;
+int shm_rx_efd = -1;
+int shm_tx_efd = -1;
+char* shm_path = NULL;
+
+struct shm_ring* shm_rx_ring = NULL;
+struct shm_ring* shm_tx_ring = NULL;
+
+extern void cleanup();
+extern void tnc_transmit(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+
+void open_shm(char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Shared memory control socket path %s is too long\r\n", path);
+        cleanup();
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    shm_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (shm_listen_fd < 0) {
+        perror("Could not open shared memory control socket");
+        cleanup();
+        exit(1);
+    }
+
+    unlink(path);
+    if (bind(shm_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(shm_listen_fd, 1) < 0) {
+        perror("Could not bind shared memory control socket");
+        cleanup();
+        exit(1);
+    }
+    shm_path = path;
+}
+
+static void shm_detach(void) {
+    if (shm_rx_ring != NULL) munmap(shm_rx_ring, 2*sizeof(struct shm_ring));
+    if (shm_mem_fd >= 0) close(shm_mem_fd);
+    if (shm_rx_efd >= 0) close(shm_rx_efd);
+    if (shm_tx_efd >= 0) close(shm_tx_efd);
+    if (shm_conn_fd >= 0) close(shm_conn_fd);
+    shm_rx_ring = NULL;
+    shm_tx_ring = NULL;
+    shm_mem_fd = -1;
+    shm_rx_efd = -1;
+    shm_tx_efd = -1;
+    shm_conn_fd = -1;
+}
+
+// Creates a fresh ring pair for a newly connected
+// consumer, and passes it the descriptors needed to
+// map the rings and wait on the doorbells.
+static void shm_attach(int conn_fd) {
+    shm_conn_fd = conn_fd;
+    size_t size = 2*sizeof(struct shm_ring);
+
+    shm_mem_fd = memfd_create("tncattach-rings", MFD_CLOEXEC);
+    if (shm_mem_fd < 0 || ftruncate(shm_mem_fd, size) < 0) {
+        LOG(LOG_ERR, "Could not create shared memory for frame rings");
+        shm_detach();
+        return;
+    }
+
+    void* rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_mem_fd, 0);
+    if (rings == MAP_FAILED) {
+        LOG(LOG_ERR, "Could not map shared memory for frame rings");
+        shm_detach();
+        return;
+    }
+    shm_rx_ring = (struct shm_ring*)rings;
+    shm_tx_ring = shm_rx_ring+1;
+
+    shm_rx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shm_tx_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shm_rx_efd < 0 || shm_tx_efd < 0) {
+        LOG(LOG_ERR, "Could not create eventfd doorbells for frame rings");
+        shm_detach();
+        return;
+    }
+
+    struct shm_info info = {
+        .version = SHM_VERSION,
+        .slots = SHM_RING_SLOTS,
+        .slot_size = sizeof(struct shm_slot),
+        .ring_size = sizeof(struct shm_ring),
+    };
+    struct iovec iov = { .iov_base = &info, .iov_len = sizeof(info) };
+    union {
+        char buf[CMSG_SPACE(SHM_FDS*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHM_FDS*sizeof(int));
+    int passed_fds[SHM_FDS] = { shm_mem_fd, shm_rx_efd, shm_tx_efd };
+    memcpy(CMSG_DATA(cmsg), passed_fds, sizeof(passed_fds));
+
+    if (sendmsg(shm_conn_fd, &msg, MSG_NOSIGNAL) < 0) {
+        LOG(LOG_ERR, "Could not pass frame rings to shared memory consumer");
+        shm_detach();
+        return;
+    }
+
+    LOG(LOG_NOTICE, "Shared memory consumer attached");
+}
+
+// Publishes a frame received from the TNC to the
+// consumer. Frames are dropped if the ring is full,
+// just like the interface would drop them.
+void shm_deliver(uint8_t* frame, int frame_len) {
+    if (shm_rx_ring == NULL) return;
+
+    uint32_t head = atomic_load_explicit(&shm_rx_ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&shm_rx_ring->tail, memory_order_acquire);
+    if (head-tail >= SHM_RING_SLOTS) {
+        METRIC_INC(drops_shm);
+        LOG(LOG_INFO, "Shared memory RX ring full, dropped %d byte frame", frame_len);
+        return;
+    }
+
+    struct shm_slot* slot = &shm_rx_ring->slots[head % SHM_RING_SLOTS];
+    memcpy(slot->data, frame, frame_len);
+    slot->len = frame_len;
+    atomic_store_explicit(&shm_rx_ring->head, head+1, memory_order_release);
+
+    uint64_t doorbell = 1;
+    if (write(shm_rx_efd, &doorbell, sizeof(doorbell)) < 0 && errno != EAGAIN) {
+        LOG(LOG_ERR, "Could not signal shared memory consumer");
+    }
+}
+
+// Transmits frames queued by the consumer directly
+// from the shared slots, without copying them out.
+static void shm_drain_tx(void) {
+    uint64_t doorbell;
+    if (read(shm_tx_efd, &doorbell, sizeof(doorbell)) < 0 && errno != EAGAIN) return;
+
+    uint32_t tail = atomic_load_explicit(&shm_tx_ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&shm_tx_ring->head, memory_order_acquire);
+    while (tail != head) {
+        struct shm_slot* slot = &shm_tx_ring->slots[tail % SHM_RING_SLOTS];
+        uint32_t len = slot->len;
+        if (len > 0 && len <= MTU_MAX) tnc_transmit(0, slot->data, len, 0);
+        tail++;
+        atomic_store_explicit(&shm_tx_ring->tail, tail, memory_order_release);
+    }
+}
+
+int shm_poll_fds(struct pollfd* fds) {
+    int n_fds = 0;
+    fds[n_fds].fd = shm_listen_fd;
+    fds[n_fds].events = POLLIN;
+    fds[n_fds++].revents = 0;
+    if (shm_conn_fd >= 0) {
+        fds[n_fds].fd = shm_conn_fd;
+        fds[n_fds].events = POLLIN;
+        fds[n_fds++].revents = 0;
+    }
+    if (shm_tx_efd >= 0) {
+        fds[n_fds].fd = shm_tx_efd;
+        fds[n_fds].events = POLLIN;
+        fds[n_fds++].revents = 0;
+    }
+    return n_fds;
+}
+
+void shm_poll_events(struct pollfd* fds, int n_fds) {
+    for (int i = 0; i < n_fds; i++) {
+        if (fds[i].revents == 0) continue;
+
+        if (fds[i].fd == shm_tx_efd && shm_tx_efd >= 0) {
+            shm_drain_tx();
+        } else if (fds[i].fd == shm_conn_fd && shm_conn_fd >= 0) {
+            // The control connection carries no data after
+            // attaching, so any event means the consumer left.
+            char discard[16];
+            if (read(shm_conn_fd, discard, sizeof(discard)) <= 0 || fds[i].revents & (POLLHUP | POLLERR)) {
+                LOG(LOG_NOTICE, "Shared memory consumer detached");
+                shm_detach();
+            }
+        } else if (fds[i].fd == shm_listen_fd) {
+            int conn_fd = accept4(shm_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (conn_fd < 0) continue;
+
+            // The rings are single consumer
+            if (shm_conn_fd >= 0) {
+                LOG(LOG_NOTICE, "Rejected shared memory consumer, one is already attached");
+                close(conn_fd);
+            } else {
+                shm_attach(conn_fd);
+            }
+        }
+    }
+}
+
+void close_shm(void) {
+    shm_detach();
+    if (shm_listen_fd >= 0) close(shm_listen_fd);
+    if (shm_path != NULL) unlink(shm_path);
+    shm_listen_fd = -1;
+    shm_path = NULL;
+}
@@ -0,0 +1,58 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "Constants.h"
+
+// A co-located process attaches by connecting to the
+// SOCK_SEQPACKET control socket. It receives a struct
+// shm_info, and as SCM_RIGHTS the memfd holding the
+// ring pair, followed by the RX and TX eventfds.
+//
+// The memfd starts with the RX ring (TNC to consumer),
+// directly followed by the TX ring (consumer to TNC).
+// Each ring is a single-producer, single-consumer
+// queue. The producer fills the slot at head, then
+// publishes it by incrementing head with release
+// semantics, and rings the doorbell eventfd. The
+// consumer reads slots up to head, acquired, and frees
+// them by advancing tail. Indexes increase freely and
+// are taken modulo the slot count.
+
+#define SHM_VERSION 1
+#define SHM_FDS 3
+
+struct shm_info {
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t ring_size;
+};
+
+struct shm_slot {
+    uint32_t len;
+    uint8_t data[MTU_MAX];
+} __attribute__((aligned(64)));
+
+struct shm_ring {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    struct shm_slot slots[SHM_RING_SLOTS];
+};
+
+#define SHM_MAX_FDS 3
+
+void open_shm(char* path);
+void close_shm(void);
+int shm_poll_fds(struct pollfd* fds);
+void shm_poll_events(struct pollfd* fds, int n_fds);
+void shm_deliver(uint8_t* frame, int frame_len);
+
+#endif
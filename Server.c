@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <syslog.h>
+#include "Server.h"
+#include "Metrics.h"
+#include "Log.h"
+
+int server_tcp_fd = -1;
+int server_unix_fd = -1;
+char* server_unix_path = NULL;
+
+struct server_client clients[SERVER_MAX_CLIENTS];
+int n_clients = 0;
+
+uint8_t client_read_buffer[MTU_MAX];
+
+extern void cleanup();
+extern void tnc_transmit(int port, uint8_t* frame, int frame_len, uint64_t read_time);
+
+static int open_tcp_listener(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    int zero = 0;
+
+    if (fd >= 0) {
+        struct sockaddr_in6 addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return fd;
+        close(fd);
+    }
+
+    // Fall back to IPv4 on hosts without IPv6 support
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int open_unix_listener(char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // Remove a stale socket left by a previous instance
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Opens the KISS server listeners. Either a TCP port,
+// a Unix socket path, or both can be specified, and
+// a port of -1 or a NULL path disables that listener.
+void open_server(int port, char* path) {
+    if (port != -1) {
+        server_tcp_fd = open_tcp_listener(port);
+        if (server_tcp_fd < 0 || listen(server_tcp_fd, SERVER_MAX_CLIENTS) < 0) {
+            perror("Could not open KISS server TCP socket");
+            cleanup();
+            exit(1);
+        }
+    }
+
+    if (path != NULL) {
+        server_unix_fd = open_unix_listener(path);
+        if (server_unix_fd < 0 || listen(server_unix_fd, SERVER_MAX_CLIENTS) < 0) {
+            perror("Could not open KISS server Unix socket");
+            cleanup();
+            exit(1);
+        }
+        server_unix_path = path;
+    }
+}
+
+static void client_close(int index) {
+    struct server_client* client = &clients[index];
+    while (client->queue_count > 0) {
+        frame_release(client->queue[client->queue_head]);
+        client->queue_head = (client->queue_head+1) % SERVER_CLIENT_QUEUE_LEN;
+        client->queue_count--;
+    }
+    close(client->fd);
+
+    // Keep the client table dense by moving
+    // the last client into the freed slot.
+    n_clients--;
+    if (index != n_clients) memcpy(&clients[index], &clients[n_clients], sizeof(struct server_client));
+}
+
+static int client_index(int fd) {
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+// Writes as much of the client queue as the socket
+// will take without blocking. Returns false if the
+// client failed and was closed.
+static bool client_flush(int index) {
+    struct server_client* client = &clients[index];
+    while (client->queue_count > 0) {
+        struct iovec iov[SERVER_CLIENT_QUEUE_LEN];
+        int iovcnt = 0;
+        for (int i = 0; i < client->queue_count; i++) {
+            struct frame* frame = client->queue[(client->queue_head+i) % SERVER_CLIENT_QUEUE_LEN];
+            int offset = i == 0 ? client->queue_offset : 0;
+            iov[iovcnt].iov_base = frame->data+offset;
+            iov[iovcnt].iov_len = frame->len-offset;
+            iovcnt++;
+        }
+
+        ssize_t written = writev(client->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            LOG(LOG_NOTICE, "KISS client on fd %d disconnected", client->fd);
+            client_close(index);
+            return false;
+        }
+
+        client->queued_bytes -= written;
+        while (written > 0) {
+            struct frame* frame = client->queue[client->queue_head];
+            int remaining = frame->len-client->queue_offset;
+            if (written >= remaining) {
+                written -= remaining;
+                client->queue_offset = 0;
+                client->queue_head = (client->queue_head+1) % SERVER_CLIENT_QUEUE_LEN;
+                client->queue_count--;
+                frame_release(frame);
+            } else {
+                client->queue_offset += written;
+                written = 0;
+            }
+        }
+    }
+    return true;
+}
+
+// Fans a frame received from the TNC out to all
+// connected clients. The frame is encoded once into
+// a pooled buffer, and every client queue references
+// the same buffer.
+void server_broadcast(uint8_t* frame, int frame_len) {
+    if (n_clients == 0) return;
+
+    struct frame* shared = frame_alloc();
+    if (shared == NULL) return;
+    shared->len = kiss_encode_frame(shared->data, frame, frame_len);
+
+    for (int i = n_clients-1; i >= 0; i--) {
+        struct server_client* client = &clients[i];
+
+        // A client that can't keep up is dropped,
+        // rather than being allowed to stall the radio.
+        if (client->queue_count == SERVER_CLIENT_QUEUE_LEN || client->queued_bytes+shared->len > SERVER_CLIENT_QUEUE_BYTES) {
+            LOG(LOG_NOTICE, "Dropping slow KISS client on fd %d", client->fd);
+            METRIC_INC(drops_server);
+            client_close(i);
+            continue;
+        }
+
+        client->queue[(client->queue_head+client->queue_count) % SERVER_CLIENT_QUEUE_LEN] = frame_ref(shared);
+        client->queue_count++;
+        client->queued_bytes += shared->len;
+        if (client->queue_count == 1) client_flush(i);
+    }
+
+    frame_release(shared);
+}
+
+static void server_accept(int listener) {
+    int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    if (n_clients == SERVER_MAX_CLIENTS) {
+        LOG(LOG_NOTICE, "Rejected KISS client on fd %d, too many clients", fd);
+        close(fd);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct server_client* client = &clients[n_clients++];
+    memset(client, 0, sizeof(struct server_client));
+    client->fd = fd;
+    client->decoder.command = CMD_UNKNOWN;
+
+    LOG(LOG_INFO, "KISS client connected on fd %d", fd);
+}
+
+static void client_read(int index) {
+    struct server_client* client = &clients[index];
+    int len = read(client->fd, client_read_buffer, sizeof(client_read_buffer));
+    if (len <= 0) {
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        LOG(LOG_NOTICE, "KISS client on fd %d disconnected", client->fd);
+        client_close(index);
+        return;
+    }
+
+    // Data frames from clients are merged into the
+    // TNC transmit path. Other commands would let one
+    // client reconfigure the TNC for everyone, and
+    // are ignored.
+    for (int i = 0; i < len; i++) {
+        if (kiss_decode(&client->decoder, client_read_buffer[i])) {
+            if (client->decoder.command == CMD_DATA && client->decoder.frame_len > 0) {
+                tnc_transmit(0, client->decoder.frame_buffer, client->decoder.frame_len, 0);
+            }
+            kiss_decoder_reset(&client->decoder);
+        }
+    }
+}
+
+int server_poll_fds(struct pollfd* fds) {
+    int n_fds = 0;
+    if (server_tcp_fd >= 0) {
+        fds[n_fds].fd = server_tcp_fd;
+        fds[n_fds].events = POLLIN;
+        fds[n_fds++].revents = 0;
+    }
+    if (server_unix_fd >= 0) {
+        fds[n_fds].fd = server_unix_fd;
+        fds[n_fds].events = POLLIN;
+        fds[n_fds++].revents = 0;
+    }
+    for (int i = 0; i < n_clients; i++) {
+        fds[n_fds].fd = clients[i].fd;
+        fds[n_fds].events = clients[i].queue_count > 0 ? POLLIN | POLLOUT : POLLIN;
+        fds[n_fds++].revents = 0;
+    }
+    return n_fds;
+}
+
+void server_poll_events(struct pollfd* fds, int n_fds) {
+    // Clients may have been closed since the poll set
+    // was built, so they are looked up by descriptor.
+    for (int i = 0; i < n_fds; i++) {
+        if (fds[i].revents == 0) continue;
+        if (fds[i].fd == server_tcp_fd || fds[i].fd == server_unix_fd) continue;
+
+        int index = client_index(fds[i].fd);
+        if (index == -1) continue;
+
+        if (fds[i].revents & POLLOUT) {
+            if (!client_flush(index)) continue;
+        }
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) client_read(index);
+    }
+
+    // Listeners are serviced last, so that a newly
+    // accepted client can't inherit stale events.
+    for (int i = 0; i < n_fds; i++) {
+        if (fds[i].revents & POLLIN) {
+            if (fds[i].fd == server_tcp_fd || fds[i].fd == server_unix_fd) server_accept(fds[i].fd);
+        }
+    }
+}
+
+void close_server(void) {
+    while (n_clients > 0) client_close(n_clients-1);
+    if (server_tcp_fd >= 0) close(server_tcp_fd);
+    if (server_unix_fd >= 0) close(server_unix_fd);
+    if (server_unix_path != NULL) unlink(server_unix_path);
+    server_tcp_fd = -1;
+    server_unix_fd = -1;
+    server_unix_path = NULL;
+}
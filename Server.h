@@ -0,0 +1,39 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "Constants.h"
+#include "KISS.h"
+#include "Pool.h"
+
+#define SERVER_MAX_FDS (SERVER_MAX_CLIENTS+2)
+
+struct server_client {
+    int fd;
+    struct kiss_decoder decoder;
+    struct frame* queue[SERVER_CLIENT_QUEUE_LEN];
+    int queue_head;
+    int queue_count;
+    int queue_offset;
+    int queued_bytes;
+};
+
+void open_server(int port, char* path);
+void close_server(void);
+int server_poll_fds(struct pollfd* fds);
+void server_poll_events(struct pollfd* fds, int n_fds);
+void server_broadcast(uint8_t* frame, int frame_len);
+
+#endif
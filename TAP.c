@@ -1,7 +1,13 @@
 #include "TAP.h"
+#include "Netlink.h"
 
 char tap_name[IFNAMSIZ];
 
+// Descriptors of all queues of a multi-queue
+// interface, the first being the one open_tap returns
+int tap_queue_fds[IF_MAX_QUEUES];
+int tap_queues = 0;
+
 extern bool verbose;
 extern bool noipv6;
 extern bool set_ipv4;
@@ -9,7 +15,10 @@ extern bool set_ipv6;
 extern bool set_linklocal;
 extern bool set_netmask;
 extern bool noup;
+extern bool persist;
+extern char* if_name_arg;
 extern int mtu;
+extern int if_queues;
 extern int device_type;
 extern char if_name[IFNAMSIZ];
 extern char* ipv4_addr;
@@ -19,59 +28,138 @@ extern char* netmask;
 extern void cleanup();
 
 
-void trySixSet
-(
-    int interfaceIndex,
-    struct in6_addr address,
-    int prefixLen
-)
-{
-    char ip_str[INET6_ADDRSTRLEN+1];
-    inet_ntop(AF_INET6, &address, ip_str, INET6_ADDRSTRLEN+1);
-
-    printf
-    (
-        "Adding IPv6 address of '%s/%d' to interface at if_index %d\n",
-        ip_str,
-        prefixLen,
-        interfaceIndex
-    );
-
-    int inet6 = socket(AF_INET6, SOCK_DGRAM, 0);
-    if(inet6 < 0)
-    {
-        printf("Error opening control socket for adding IPv6 address to interface\n");
-        cleanup();
-        exit(1);
+// Prefix length of a dotted quad netmask, or of the
+// address class when no netmask was given, which is
+// what SIOCSIFADDR would have used.
+static int ipv4_prefix_len(struct in_addr addr) {
+    if (set_netmask) {
+        struct in_addr mask;
+        if (inet_pton(AF_INET, netmask, &mask) != 1) {
+            printf("Error: Invalid subnet mask specified\r\n");
+            return -1;
+        }
+        return __builtin_popcount(mask.s_addr);
     }
 
-    struct in6_ifreq paramReq;
-    memset(&paramReq, 0, sizeof(struct in6_ifreq));
-    paramReq.ifr6_ifindex = interfaceIndex;
-    paramReq.ifr6_prefixlen = prefixLen;
-    paramReq.ifr6_addr = address;
-
-
-    // Try add the address
-    if(ioctl(inet6, SIOCSIFADDR, &paramReq) < 0)
-    {
-        printf
-        (
-            "There was an errror assigning address '%s/%d' to if_index %d\n",
-            ip_str,
-            prefixLen,
-            interfaceIndex
-        );
-        cleanup();
-        close(inet6);
-        exit(1);
+    uint8_t first = ntohl(addr.s_addr) >> 24;
+    if (first < 128) return 8;
+    if (first < 192) return 16;
+    return 24;
+}
+
+static void add_neigh_parms(struct nl_batch* batch, int family, const char* table, int if_index, const char* what, bool optional) {
+    struct nlmsghdr* msg = nl_batch_msg(batch, RTM_SETNEIGHTBL, 0, what, optional);
+    struct ndtmsg ndtm = { .ndtm_family = family };
+    nl_msg_put(batch, msg, &ndtm, sizeof(ndtm));
+    nl_attr_put(batch, msg, NDTA_NAME, table, strlen(table)+1);
+
+    uint32_t index = if_index;
+    uint64_t base_reachable_time = ARP_BASE_REACHABLE_TIME*1000;
+    uint64_t retrans_time = ARP_RETRANS_TIME*1000;
+    struct rtattr* parms = nl_attr_nest(batch, msg, NDTA_PARMS);
+    nl_attr_put(batch, msg, NDTPA_IFINDEX, &index, sizeof(index));
+    nl_attr_put(batch, msg, NDTPA_BASE_REACHABLE_TIME, &base_reachable_time, sizeof(base_reachable_time));
+    nl_attr_put(batch, msg, NDTPA_RETRANS_TIME, &retrans_time, sizeof(retrans_time));
+    nl_attr_nest_end(batch, parms);
+}
+
+static void add_address(struct nl_batch* batch, int family, const void* addr, int addr_len, const void* broadcast, int prefix_len, int if_index, const char* what) {
+    // Replacing makes this work on a persistent
+    // interface that already has the address
+    struct nlmsghdr* msg = nl_batch_msg(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, what, false);
+    struct ifaddrmsg ifa = { .ifa_family = family, .ifa_prefixlen = prefix_len, .ifa_scope = RT_SCOPE_UNIVERSE, .ifa_index = if_index };
+    nl_msg_put(batch, msg, &ifa, sizeof(ifa));
+    nl_attr_put(batch, msg, IFA_LOCAL, addr, addr_len);
+    nl_attr_put(batch, msg, IFA_ADDRESS, addr, addr_len);
+    if (broadcast != NULL) nl_attr_put(batch, msg, IFA_BROADCAST, broadcast, addr_len);
+}
+
+// Configures the interface with a single batch of
+// rtnetlink requests. The link is set up before it
+// is brought up, and addresses are added once it is,
+// along with their prefix routes. Interfaces for
+// further KISS ports get no addresses.
+static bool configure_tap(int if_index, bool addresses) {
+    struct in_addr ipv4;
+    struct in_addr ipv4_broadcast;
+    struct in6_addr ipv6;
+    int ipv4_prefix = 0;
+
+    bool add_ipv4 = addresses && set_ipv4;
+    bool add_ipv6 = addresses && set_ipv6;
+
+    if (!noup && add_ipv4) {
+        if (inet_pton(AF_INET, ipv4_addr, &ipv4) != 1) {
+            printf("Error: Invalid IPv4 address specified\r\n");
+            return false;
+        }
+        ipv4_prefix = ipv4_prefix_len(ipv4);
+        if (ipv4_prefix < 0) return false;
+        uint32_t host_mask = ipv4_prefix == 32 ? 0 : 0xFFFFFFFF >> ipv4_prefix;
+        ipv4_broadcast.s_addr = ipv4.s_addr | htonl(host_mask);
     }
 
-    printf("Address '%s/%d' added\n", ip_str, prefixLen);
-    close(inet6);
+    if (!noup && add_ipv6) {
+        if (inet_pton(AF_INET6, ipv6_addr, &ipv6) != 1) {
+            printf("Error parsing IPv6 address '%s'\n", ipv6_addr);
+            return false;
+        }
+    }
+
+    struct nl_batch* batch = malloc(sizeof(struct nl_batch));
+    if (batch == NULL) {
+        printf("Error: Could not allocate netlink batch\r\n");
+        return false;
+    }
+    nl_batch_init(batch);
+
+    struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC, .ifi_index = if_index };
+    struct nlmsghdr* msg = nl_batch_msg(batch, RTM_NEWLINK, 0, "configure interface MTU and TX queue length", false);
+    uint32_t link_mtu = mtu;
+    uint32_t txqlen = TXQUEUELEN;
+    nl_msg_put(batch, msg, &ifi, sizeof(ifi));
+    nl_attr_put(batch, msg, IFLA_MTU, &link_mtu, sizeof(link_mtu));
+    nl_attr_put(batch, msg, IFLA_TXQLEN, &txqlen, sizeof(txqlen));
+
+    // Unless requested, no link-local address is
+    // generated next to the configured IPv6 address
+    if (add_ipv6 && !set_linklocal) {
+        msg = nl_batch_msg(batch, RTM_NEWLINK, 0, "disable IPv6 link-local address", false);
+        nl_msg_put(batch, msg, &ifi, sizeof(ifi));
+        uint8_t addr_gen_mode = IN6_ADDR_GEN_MODE_NONE;
+        struct rtattr* af_spec = nl_attr_nest(batch, msg, IFLA_AF_SPEC);
+        struct rtattr* inet6 = nl_attr_nest(batch, msg, AF_INET6);
+        nl_attr_put(batch, msg, IFLA_INET6_ADDR_GEN_MODE, &addr_gen_mode, sizeof(addr_gen_mode));
+        nl_attr_nest_end(batch, inet6);
+        nl_attr_nest_end(batch, af_spec);
+    }
+
+    // Neighbour discovery timings. IPv6 may be
+    // disabled on the system, in which case there
+    // are no ND parameters to set.
+    if (device_type == IF_TAP) {
+        add_neigh_parms(batch, AF_INET, "arp_cache", if_index, "configure interface ARP parameters", false);
+        if (!noipv6) add_neigh_parms(batch, AF_INET6, "ndisc_cache", if_index, "configure interface ND parameters", true);
+    }
+
+    if (!noup) {
+        struct ifinfomsg up = { .ifi_family = AF_UNSPEC, .ifi_index = if_index, .ifi_flags = IFF_UP, .ifi_change = IFF_UP };
+        msg = nl_batch_msg(batch, RTM_NEWLINK, 0, "bring up interface", false);
+        nl_msg_put(batch, msg, &up, sizeof(up));
+
+        if (add_ipv4) add_address(batch, AF_INET, &ipv4, sizeof(ipv4), device_type == IF_TAP ? &ipv4_broadcast : NULL, ipv4_prefix, if_index, "set IP-address");
+        if (add_ipv6) add_address(batch, AF_INET6, &ipv6, sizeof(ipv6), NULL, ipv6_prefixLen, if_index, "set IPv6 address");
+    }
+
+    bool success = nl_batch_run(batch);
+    free(batch);
+    return success;
 }
 
-int open_tap(void) {
+// Creates or attaches to the named interface, and
+// configures it. The kernel fills in the name when it
+// holds a pattern like tnc%d.
+static int tap_create(char* name, bool addresses) {
     struct ifreq ifr;
     int fd = open("/dev/net/tun", O_RDWR);
 
@@ -91,207 +179,42 @@ int open_tap(void) {
             cleanup();
             exit(1);
         }
+        if (if_queues > 1) ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
-        strcpy(tap_name, "tnc%d");
-        strncpy(ifr.ifr_name, tap_name, IFNAMSIZ);
+        strncpy(ifr.ifr_name, name, IFNAMSIZ);
 
         if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
             perror("Could not configure network interface");
             exit(1);
         } else {
-            strcpy(if_name, ifr.ifr_name);
+            strcpy(name, ifr.ifr_name);
+
+            // On any failure, closing the descriptor
+            // removes the half configured interface,
+            // unless it already existed as a persistent
+            // interface before tncattach was started.
+            int if_index = if_nametoindex(name);
+            if (if_index == 0) {
+                perror("Could not get interface index");
+                close(fd);
+                cleanup();
+                exit(1);
+            }
+
+            if (!configure_tap(if_index, addresses)) {
+                close(fd);
+                cleanup();
+                exit(1);
+            }
 
-            
-            int inet = socket(AF_INET, SOCK_DGRAM, 0);
-            if (inet == -1) {
-                perror("Could not open control socket");
+            // A persistent interface survives tncattach
+            // exiting, and is attached to again by name,
+            // with its addresses and routes left in place.
+            if (persist && ioctl(fd, TUNSETPERSIST, 1) < 0) {
+                perror("Could not make network interface persistent");
+                close(fd);
                 cleanup();
                 exit(1);
-            } else {
-                if (ioctl(inet, SIOCGIFMTU, &ifr) < 0) {
-                    perror("Could not get interface flags from kernel");
-                    close(inet);
-                    cleanup();
-                    exit(1);
-                } else {
-                    ifr.ifr_mtu = mtu;
-                    if (ioctl(inet, SIOCSIFMTU, &ifr) < 0) {
-                        perror("Could not configure interface MTU");
-                        close(inet);
-                        cleanup();
-                        exit(1);
-                    }
-
-                    // Configure TX queue length
-                    if (ioctl(inet, SIOCGIFTXQLEN, &ifr) < 0) {
-                        perror("Could not get interface flags from kernel");
-                        close(inet);
-                        cleanup();
-                        exit(1);
-                    } else {
-                        ifr.ifr_qlen = TXQUEUELEN;
-                        if (ioctl(inet, SIOCSIFTXQLEN, &ifr) < 0) {
-                            perror("Could not set interface TX queue length");
-                            close(inet);
-                            cleanup();
-                            exit(1);
-                        }
-                    }
-
-                    // Configure ARP characteristics
-                    char path_buf[256];
-                    if (device_type == IF_TAP) {
-                        snprintf(path_buf, sizeof(path_buf), "/proc/sys/net/ipv4/neigh/%s/base_reachable_time_ms", ifr.ifr_name);
-                        int arp_fd = open(path_buf, O_WRONLY);
-                        if (arp_fd < 0) {
-                            perror("Could not open proc entry for ARP parameters");
-                            close(inet);
-                            cleanup();
-                            exit(1);
-                        } else {
-                            if (dprintf(arp_fd, "%d", ARP_BASE_REACHABLE_TIME*1000) <= 0) {
-                                perror("Could not configure interface ARP parameter base_reachable_time_ms");
-                                close(inet);
-                                close(arp_fd);
-                                cleanup();
-                                exit(1);
-                            } else {
-                                close(arp_fd);
-                            }
-                        }
-
-                        snprintf(path_buf, sizeof(path_buf), "/proc/sys/net/ipv4/neigh/%s/retrans_time_ms", ifr.ifr_name);
-                        arp_fd = open(path_buf, O_WRONLY);
-                        if (arp_fd < 0) {
-                            perror("Could not open proc entry for ARP parameters");
-                            close(inet);
-                            cleanup();
-                            exit(1);
-                        } else {
-                            if (dprintf(arp_fd, "%d", ARP_RETRANS_TIME*1000) <= 0) {
-                                perror("Could not configure interface ARP parameter retrans_time_ms");
-                                close(inet);
-                                close(arp_fd);
-                                cleanup();
-                                exit(1);
-                            } else {
-                                close(arp_fd);
-                            }
-                        }
-                    }
-
-                    // Bring up if requested
-                    if (!noup) {
-                        if (ioctl(inet, SIOCGIFFLAGS, &ifr) < 0) {
-                            perror("Could not get interface flags from kernel");
-                            close(inet);
-                            cleanup();
-                            exit(1);
-                        } else {
-                            ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
-                            if (ioctl(inet, SIOCSIFFLAGS, &ifr) < 0) {
-                                perror("Could not bring up interface");
-                                close(inet);
-                                cleanup();
-                                exit(1);
-                            } else {
-                                if (set_ipv4) {
-                                    struct ifreq a_ifr;
-                                    struct sockaddr_in addr, snm;
-
-                                    memset(&a_ifr, 0, sizeof(a_ifr));
-                                    memset(&addr, 0, sizeof(addr));
-                                    memset(&snm, 0, sizeof(addr));
-                                    strncpy(a_ifr.ifr_name, ifr.ifr_name, IFNAMSIZ);
-                                    addr.sin_family = AF_INET;
-                                    snm.sin_family = AF_INET;
-
-                                    int addr_conversion = inet_pton(AF_INET, ipv4_addr, &(addr.sin_addr));
-                                    if (addr_conversion != 1) {
-                                        printf("Error: Invalid IPv4 address specified\r\n");
-                                        close(inet);
-                                        cleanup();
-                                        exit(1);
-                                    } else {
-                                        a_ifr.ifr_addr = *(struct sockaddr*)&addr;
-                                        if (ioctl(inet, SIOCSIFADDR, &a_ifr) < 0) {
-                                            perror("Could not set IP-address");
-                                            close(inet);
-                                            cleanup();
-                                            exit(1);
-                                        } else {
-                                            if (set_netmask) {
-                                                int snm_conversion = inet_pton(AF_INET, netmask, &(snm.sin_addr));
-                                                if (snm_conversion != 1) {
-                                                    printf("Error: Invalid subnet mask specified\r\n");
-                                                    close(inet);
-                                                    cleanup();
-                                                    exit(1);
-                                                } else {
-                                                    a_ifr.ifr_addr = *(struct sockaddr*)&snm;
-                                                    if (ioctl(inet, SIOCSIFNETMASK, &a_ifr) < 0) {
-                                                        perror("Could not set subnet mask");
-                                                        close(inet);
-                                                        cleanup();
-                                                        exit(1);
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-
-                                if(set_ipv6 || set_linklocal)
-                                {
-                                    // Firstly, obtain the interface index by `ifr_name`
-                                    int inet6 = socket(AF_INET6, SOCK_DGRAM, 0);
-                                    if(inet6 < 0)
-                                    {
-                                        printf("Error opening control socket for adding IPv6 address to interface\n");
-                                        cleanup();
-                                        exit(1);
-                                    }
-
-                                    if(ioctl(inet6, SIOCGIFINDEX, &ifr) < 0)
-                                    {
-                                        printf("Could not get interface index for interface '%s'\n", ifr.ifr_name);
-                                        close(inet6);
-                                        cleanup();
-                                        exit(1);
-                                    }
-
-                                    // if link-local was NOT requested and interface
-                                    // has been up'd -> then kernel would have added
-                                    // a link-local already, this removes it
-                                    if(!set_linklocal & !noup)
-                                    {
-                                    		// TODO: Get all addresses that start with fe80
-                                    }
-                                    // Else it could have been no-up; hence you will have to remove
-                                    // the link-local yourself
-                                    // Other else is link-local was requested, then we don't care (whether
-                                    // up'd or not as it will inevitably be added by the kernel)
-
-                                    // Convert ASCII IPv6 address to ABI structure
-                                    struct in6_addr six_addr_itself;
-                                    memset(&six_addr_itself, 0, sizeof(struct in6_addr));
-                                    if(inet_pton(AF_INET6, ipv6_addr, &six_addr_itself) < 0)
-                                    {
-                                        printf("Error parsing IPv6 address '%s'\n", ipv6_addr);
-                                        close(inet6);
-                                        cleanup();
-                                        exit(1);
-                                    }
-
-                                    // Add user's requested address
-                                    trySixSet(ifr.ifr_ifindex, six_addr_itself, ipv6_prefixLen);
-
-                                    close(inet6);
-                                }
-                            }
-                        }
-                    }
-                }
             }
 
             return fd;
@@ -299,6 +222,59 @@ int open_tap(void) {
     }
 }
 
+int open_tap(void) {
+    if (if_name_arg != NULL) {
+        strcpy(tap_name, if_name_arg);
+    } else {
+        strcpy(tap_name, "tnc%d");
+    }
+
+    int fd = tap_create(tap_name, true);
+    strcpy(if_name, tap_name);
+    tap_queue_fds[0] = fd;
+    tap_queues = 1;
+    return fd;
+}
+
+// Creates the interface for a further KISS port of
+// the TNC, named after the first interface
+int open_tap_port(int port, char* port_if_name) {
+    if (snprintf(port_if_name, IFNAMSIZ, "%sp%d", if_name, port) >= IFNAMSIZ) {
+        printf("Error: Interface name %s is too long to name further ports after\r\n", if_name);
+        cleanup();
+        exit(1);
+    }
+    return tap_create(port_if_name, false);
+}
+
+// Attaches one more queue to a multi-queue interface.
+// The kernel spreads frames over the queues by flow,
+// so each flow is always read from the same queue.
+int open_tap_queue(void) {
+    struct ifreq ifr;
+    int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Could not open clone device");
+        cleanup();
+        exit(1);
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = (device_type == IF_TAP ? IFF_TAP | IFF_NO_PI : IFF_TUN) | IFF_MULTI_QUEUE;
+    strncpy(ifr.ifr_name, if_name, IFNAMSIZ);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        perror("Could not attach interface queue");
+        close(fd);
+        cleanup();
+        exit(1);
+    }
+
+    tap_queue_fds[tap_queues++] = fd;
+    return fd;
+}
+
 int close_tap(int tap_fd) {
+    for (int i = 1; i < tap_queues; i++) close(tap_queue_fds[i]);
+    tap_queues = 0;
     return close(tap_fd);
 }
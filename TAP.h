@@ -13,4 +13,6 @@
 #include "Constants.h"
 
 int open_tap(void);
+int open_tap_queue(void);
+int open_tap_port(int port, char* port_if_name);
 int close_tap(int tap_fd);
\ No newline at end of file
@@ -1,37 +1,289 @@
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "TCP.h"
+#include "KISS.h"
+#include "Pipeline.h"
+#include "Reattach.h"
+#include "Timer.h"
+#include "Log.h"
 
-int open_tcp(char* ip, int port) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+int tcp_state = TCP_DISCONNECTED;
+int tcp_backoff = TCP_BACKOFF_MIN;
 
-    if (sockfd < 0) {
-        perror("Could not open AF_INET socket");
-        exit(1);
+// Times out a connect in progress, or starts the
+// next attempt while disconnected
+static void tcp_reconnect(void);
+static void tcp_schedule_reconnect(void);
+struct timer tcp_timer = { .callback = tcp_reconnect };
+
+// Addresses of the TNC host, which are tried in turn
+// until one of them connects. The host is only looked
+// up again once all of them have failed, and then on
+// a helper thread, so that a stalled resolver never
+// holds up the main loop. The helper signals the
+// eventfd when it is done.
+struct sockaddr_storage tcp_addrs[TCP_MAX_ADDRS];
+socklen_t tcp_addr_lens[TCP_MAX_ADDRS];
+int tcp_addr_count = 0;
+int tcp_addr_next = 0;
+int tcp_addr_current = 0;
+
+pthread_t tcp_resolver;
+bool tcp_resolving = false;
+int tcp_resolve_efd = -1;
+struct addrinfo* tcp_resolved = NULL;
+int tcp_resolve_result = 0;
+
+extern bool daemonize;
+extern int attached_tnc;
+extern char* tcp_host;
+extern int tcp_port;
+extern bool threaded;
+extern int outage_queue_count;
+extern void cleanup(void);
+
+static struct addrinfo* tcp_resolve(char* host, int port, int* gai_result) {
+    struct addrinfo hints, *result;
+    char port_str[8];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    *gai_result = getaddrinfo(host, port_str, &hints, &result);
+    return *gai_result == 0 ? result : NULL;
+}
+
+static void tcp_resolve_failed(char* host, int gai_result) {
+    if (daemonize) {
+        syslog(LOG_ERR, "Error resolving host %s: %s", host, gai_strerror(gai_result));
+    } else {
+        printf("Error resolving host %s: %s\r\n", host, gai_strerror(gai_result));
     }
+}
 
-    struct hostent *server;
-    struct sockaddr_in serv_addr;
+static void tcp_cache_addrs(struct addrinfo* result) {
+    tcp_addr_count = 0;
+    tcp_addr_next = 0;
+    for (struct addrinfo* rp = result; rp != NULL && tcp_addr_count < TCP_MAX_ADDRS; rp = rp->ai_next) {
+        if (rp->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+        memcpy(&tcp_addrs[tcp_addr_count], rp->ai_addr, rp->ai_addrlen);
+        tcp_addr_lens[tcp_addr_count++] = rp->ai_addrlen;
+    }
+    freeaddrinfo(result);
+}
 
-    server = gethostbyname(ip);
+// Starts a nonblocking connect to the next address
+// that accepts one. Returns the socket, or -1 once
+// every address has been tried. Completion is
+// signalled by the socket becoming writable, see
+// tcp_connect_complete.
+static int tcp_connect_next(void) {
+    while (tcp_addr_next < tcp_addr_count) {
+        int index = tcp_addr_next++;
+        struct sockaddr* addr = (struct sockaddr*)&tcp_addrs[index];
+        int sockfd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) continue;
 
-    if (server == NULL) {
-        perror("Error resolving host");
-        exit(1);
+        if (connect(sockfd, addr, tcp_addr_lens[index]) == 0 || errno == EINPROGRESS) {
+            tcp_addr_current = index;
+            tcp_state = TCP_CONNECTING;
+            timer_arm(&tcp_timer, TCP_CONNECT_TIMEOUT);
+            return sockfd;
+        }
+        close(sockfd);
     }
+    return -1;
+}
 
-    memset(&serv_addr, 0, sizeof(serv_addr)); 
-    serv_addr.sin_family = AF_INET;
+static void* tcp_resolve_thread(void* arg) {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-    memcpy(server->h_addr, &serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(port);
+    tcp_resolved = tcp_resolve(tcp_host, tcp_port, &tcp_resolve_result);
+    uint64_t doorbell = 1;
+    ssize_t signalled = write(tcp_resolve_efd, &doorbell, sizeof(doorbell));
+    (void)signalled;
+    return NULL;
+}
 
-    if (connect(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Could not connect TCP socket");
+// Looks the host up again in the background. The
+// connection is started from tcp_poll_events when the
+// addresses are known.
+static void tcp_resolve_start(void) {
+    if (pthread_create(&tcp_resolver, NULL, tcp_resolve_thread, NULL) != 0) {
+        LOG(LOG_ERR, "Could not start TCP resolver thread");
+        tcp_schedule_reconnect();
+        return;
+    }
+    tcp_resolving = true;
+}
+
+// Resolves the host when the program starts, before
+// the main loop runs, and starts a connect to the
+// first address that accepts one. Returns the socket,
+// or -1 if no connection could be started.
+int open_tcp(char* host, int port) {
+    if (tcp_resolve_efd < 0) tcp_resolve_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (tcp_resolve_efd < 0) {
+        perror("Could not create TCP resolver eventfd");
+        cleanup();
         exit(1);
     }
 
+    int gai_result;
+    struct addrinfo* result = tcp_resolve(host, port, &gai_result);
+    if (result == NULL) {
+        tcp_resolve_failed(host, gai_result);
+        return -1;
+    }
+    tcp_cache_addrs(result);
+
+    int sockfd = tcp_connect_next();
+    if (sockfd < 0) LOG(LOG_ERR, "Could not connect TCP socket");
     return sockfd;
 }
 
+// Checks the result of a nonblocking connect and
+// configures the established socket for KISS use.
+bool tcp_connect_complete(int fd) {
+    int so_error = 0;
+    socklen_t so_error_len = sizeof(so_error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) < 0 || so_error != 0) {
+        return false;
+    }
+
+    // KISS frames are small and latency sensitive,
+    // don't let Nagle hold them back.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Detect dead peers even when the channel is idle
+    int keepidle = TCP_KEEPALIVE_IDLE;
+    int keepintvl = TCP_KEEPALIVE_INTERVAL;
+    int keepcnt = TCP_KEEPALIVE_COUNT;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
+
+    // The socket stays nonblocking, so a TNC that stops
+    // reading can't hold up the main loop. What it does
+    // not take of a frame is kept by the KISS writer,
+    // and further frames wait in the outage queue until
+    // the socket is writable again, see tcp_writable.
+
+    tcp_state = TCP_CONNECTED;
+    tcp_backoff = TCP_BACKOFF_MIN;
+    timer_cancel(&tcp_timer);
+
+    if (daemonize) {
+        syslog(LOG_NOTICE, "Connected to TNC at %s port %d", tcp_host, tcp_port);
+    } else {
+        printf("Connected to TNC at %s port %d\r\n", tcp_host, tcp_port);
+    }
+
+    outage_flush();
+    return true;
+}
+
 int close_tcp(int fd) {
+    if (fd < 0) return 0;
     return close(fd);
-}
\ No newline at end of file
+}
+
+static void tcp_schedule_reconnect(void) {
+    tcp_state = TCP_DISCONNECTED;
+    timer_arm(&tcp_timer, tcp_backoff);
+    LOG(LOG_INFO, "Reconnecting to TNC in %d ms", tcp_backoff);
+
+    tcp_backoff *= 2;
+    if (tcp_backoff > TCP_BACKOFF_MAX) tcp_backoff = TCP_BACKOFF_MAX;
+}
+
+// Called when the TCP connection to the TNC fails or
+// hangs up. The network interface is left untouched
+// while reconnection is attempted in the background.
+// A connect that failed moves on to the next address
+// right away, and a connection that was lost is first
+// retried on the address it was made to.
+void tcp_link_lost(void) {
+    bool connecting = tcp_state == TCP_CONNECTING;
+    if (tcp_state == TCP_CONNECTED) {
+        LOG(LOG_ERR, "Lost connection to TNC");
+        tcp_addr_next = tcp_addr_current;
+    }
+    if (threaded) pipeline_stop_tnc_reader();
+    close_tcp(attached_tnc);
+    kiss_discard_pending(attached_tnc);
+    attached_tnc = -1;
+
+    if (connecting) {
+        attached_tnc = tcp_connect_next();
+        if (attached_tnc >= 0) return;
+    }
+    tcp_schedule_reconnect();
+}
+
+static void tcp_reconnect(void) {
+    if (tcp_state == TCP_CONNECTED) return;
+
+    if (tcp_state == TCP_CONNECTING) {
+        LOG(LOG_ERR, "Timed out connecting to TNC");
+        tcp_link_lost();
+    } else if (!tcp_resolving) {
+        attached_tnc = tcp_connect_next();
+        if (attached_tnc < 0) tcp_resolve_start();
+    }
+}
+
+// True while the TNC has not taken all of the last
+// frame written to it, or frames are waiting for it
+bool tcp_backlogged(void) {
+    return kiss_has_pending() || outage_queue_count > 0;
+}
+
+// Called when a connected TNC that had fallen behind
+// is writable again
+void tcp_writable(void) {
+    int left = kiss_write_pending(attached_tnc);
+    if (left < 0) {
+        tcp_link_lost();
+    } else if (left == 0) {
+        outage_flush();
+    }
+}
+
+int tcp_poll_fds(struct pollfd* fds) {
+    fds[0].fd = tcp_resolving ? tcp_resolve_efd : -1;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return TCP_MAX_FDS;
+}
+
+void tcp_poll_events(struct pollfd* fds, int n_fds) {
+    if (!(fds[0].revents & POLLIN)) return;
+
+    uint64_t doorbells;
+    if (read(tcp_resolve_efd, &doorbells, sizeof(doorbells)) < 0) return;
+    pthread_join(tcp_resolver, NULL);
+    tcp_resolving = false;
+
+    if (tcp_resolved == NULL) {
+        tcp_resolve_failed(tcp_host, tcp_resolve_result);
+        tcp_schedule_reconnect();
+        return;
+    }
+    tcp_cache_addrs(tcp_resolved);
+    tcp_resolved = NULL;
+
+    attached_tnc = tcp_connect_next();
+    if (attached_tnc < 0) {
+        LOG(LOG_ERR, "Could not connect TCP socket");
+        tcp_schedule_reconnect();
+    }
+}
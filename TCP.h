@@ -1,9 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "Constants.h"
+
+#define TCP_DISCONNECTED 0
+#define TCP_CONNECTING 1
+#define TCP_CONNECTED 2
+
+#define TCP_MAX_FDS 1
+
+int open_tcp(char* host, int port);
+bool tcp_connect_complete(int fd);
+int close_tcp(int fd);
+
+void tcp_link_lost(void);
+bool tcp_backlogged(void);
+void tcp_writable(void);
+int tcp_poll_fds(struct pollfd* fds);
+void tcp_poll_events(struct pollfd* fds, int n_fds);
 
-int open_tcp(char* ip, int port);
-int close_tcp(int fd);
\ No newline at end of file
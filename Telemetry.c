@@ -0,0 +1,116 @@
+#include "Telemetry.h"
+#include "KISS.h"
+#include "Bond.h"
+#include "Metrics.h"
+
+// RNode-class TNCs report the signal of every frame
+// they receive in status frames sent just before the
+// frame itself, and the use of the channel in status
+// frames sent every few seconds. Signal strength is
+// sent offset to fit a byte, and the signal to noise
+// ratio as a signed byte in quarter dB. Channel
+// statistics are pairs of short and long term shares
+// in hundredths of a percent, in network byte order,
+// followed by the current signal strength and noise
+// floor on newer firmware.
+
+#define CHTM_LEN 8
+#define CHTM_NOISE_FLOOR_LEN 10
+
+struct link_telemetry telemetry[TELEMETRY_MAX_LINKS];
+struct source_telemetry telemetry_sources[TELEMETRY_SOURCES];
+int telemetry_source_count = 0;
+pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int device_type;
+
+static int get16(uint8_t* data) {
+    return (data[0] << 8) | data[1];
+}
+
+// Handles a frame from the TNC that does not carry
+// data. Returns false if the frame is not a status
+// report that is understood.
+bool telemetry_frame(int link, uint8_t command, uint8_t* data, int len) {
+    struct link_telemetry* t = &telemetry[link];
+
+    if (command == CMD_STAT_RSSI && len >= 1) {
+        t->pending_rssi = data[0]-RSSI_OFFSET;
+        t->signal_pending = true;
+        atomic_store_explicit(&t->rssi, t->pending_rssi, memory_order_relaxed);
+    } else if (command == CMD_STAT_SNR && len >= 1) {
+        t->pending_snr = (int8_t)data[0];
+        t->signal_pending = true;
+        atomic_store_explicit(&t->snr, t->pending_snr, memory_order_relaxed);
+    } else if (command == CMD_STAT_CHTM && len >= CHTM_LEN) {
+        atomic_store_explicit(&t->airtime_short, get16(data), memory_order_relaxed);
+        atomic_store_explicit(&t->airtime_long, get16(data+2), memory_order_relaxed);
+        atomic_store_explicit(&t->channel_load_short, get16(data+4), memory_order_relaxed);
+        atomic_store_explicit(&t->channel_load_long, get16(data+6), memory_order_relaxed);
+        if (len >= CHTM_NOISE_FLOOR_LEN) {
+            atomic_store_explicit(&t->noise_floor, data[9]-RSSI_OFFSET, memory_order_relaxed);
+        }
+    } else {
+        return false;
+    }
+
+    atomic_fetch_add_explicit(&t->frames, 1, memory_order_relaxed);
+    atomic_store_explicit(&t->updated, metrics_now(), memory_order_relaxed);
+    return true;
+}
+
+// Finds the entry for a station, or takes the one
+// heard from longest ago when the table is full.
+// Must be called with the lock held.
+static struct source_telemetry* telemetry_source(uint8_t* mac) {
+    int oldest = 0;
+    for (int i = 0; i < telemetry_source_count; i++) {
+        if (memcmp(telemetry_sources[i].mac, mac, 6) == 0) return &telemetry_sources[i];
+        if (telemetry_sources[i].last_heard < telemetry_sources[oldest].last_heard) oldest = i;
+    }
+
+    if (telemetry_source_count < TELEMETRY_SOURCES) oldest = telemetry_source_count++;
+    struct source_telemetry* source = &telemetry_sources[oldest];
+    memset(source, 0, sizeof(*source));
+    memcpy(source->mac, mac, 6);
+    return source;
+}
+
+// Credits the signal reported before a data frame to
+// the station that sent it. Frames from TNCs that
+// don't report signal never take the lock.
+void telemetry_data_frame(int link, uint8_t* frame, int frame_len) {
+    struct link_telemetry* t = &telemetry[link];
+    if (!t->signal_pending) return;
+    t->signal_pending = false;
+
+    // Striped frames carry their sequence number in
+    // front of the Ethernet header
+    int offset = bond_striped ? STRIPE_HEADER_LEN : 0;
+    if (device_type != IF_TAP || frame_len < offset+ETHERNET_MIN_FRAME_SIZE) return;
+
+    pthread_mutex_lock(&telemetry_lock);
+    struct source_telemetry* source = telemetry_source(frame+offset+6);
+    source->link = link;
+    source->rssi = t->pending_rssi;
+    source->snr = t->pending_snr;
+    source->frames++;
+    source->last_heard = metrics_now();
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+// Reports older than TELEMETRY_MAX_AGE are not taken
+// into account, since the TNC has stopped sending them
+bool telemetry_current(int link) {
+    uint64_t updated = atomic_load_explicit(&telemetry[link].updated, memory_order_relaxed);
+    return updated != 0 && metrics_now()-updated < (uint64_t)TELEMETRY_MAX_AGE*1000000000;
+}
+
+// The short term share of time the channel of a link
+// was busy, from 0 to 1, or 0 when it is not known
+double telemetry_channel_load(int link) {
+    if (!telemetry_current(link)) return 0;
+    int load = atomic_load_explicit(&telemetry[link].channel_load_short, memory_order_relaxed);
+    if (load > 10000) load = 10000;
+    return load/10000.0;
+}
@@ -0,0 +1,61 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include "Constants.h"
+
+#define TELEMETRY_MAX_LINKS (BOND_MAX_LINKS+1)
+
+// What an RNode-class TNC last reported about a
+// link. Signal strength is in dBm, signal to noise
+// ratio in quarter dB, and channel shares in
+// hundredths of a percent. Links are read on the
+// reader threads as well, so reported values are
+// atomic. A signal report belongs to the data frame
+// that follows it, and is held in the pending fields,
+// which only the thread decoding the link touches,
+// until that frame arrives.
+struct link_telemetry {
+    _Atomic uint64_t updated;
+    _Atomic uint64_t frames;
+    _Atomic int rssi;
+    _Atomic int snr;
+    _Atomic int noise_floor;
+    _Atomic int airtime_short;
+    _Atomic int airtime_long;
+    _Atomic int channel_load_short;
+    _Atomic int channel_load_long;
+
+    bool signal_pending;
+    int pending_rssi;
+    int pending_snr;
+};
+
+// Signal of frames heard from one station, keyed by
+// its source MAC address in TAP mode
+struct source_telemetry {
+    uint8_t mac[6];
+    int link;
+    int rssi;
+    int snr;
+    uint64_t frames;
+    uint64_t last_heard;
+};
+
+extern struct link_telemetry telemetry[TELEMETRY_MAX_LINKS];
+extern struct source_telemetry telemetry_sources[TELEMETRY_SOURCES];
+extern int telemetry_source_count;
+extern pthread_mutex_t telemetry_lock;
+
+bool telemetry_frame(int link, uint8_t command, uint8_t* data, int len);
+void telemetry_data_frame(int link, uint8_t* frame, int frame_len);
+bool telemetry_current(int link);
+double telemetry_channel_load(int link);
+
+#endif
@@ -0,0 +1,165 @@
+#include <time.h>
+#include <sys/timerfd.h>
+#include "Timer.h"
+
+// All timers share a single timerfd, which is always
+// set to the earliest expiry, or disarmed when no
+// timer is pending. Nothing wakes the main loop up
+// unless some timer is actually due.
+//
+// Pending timers are hashed into a wheel of slots by
+// their expiry tick, so arming and cancelling take
+// constant time, and only the slots for the ticks that
+// have passed are looked at when the timerfd fires.
+// Timers further out than one turn of the wheel stay
+// in their slot until the turn they are due in.
+
+#define TIMER_TICK_NS ((uint64_t)TIMER_TICK*1000000)
+
+struct timer* wheel[TIMER_WHEEL_SLOTS];
+uint64_t wheel_tick = 0;
+int timers_pending = 0;
+int timer_fd = -1;
+uint64_t timer_fd_expires = 0;
+
+extern void cleanup(void);
+
+uint64_t timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void open_timers(void) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        perror("Could not create timer");
+        cleanup();
+        exit(1);
+    }
+    wheel_tick = timer_now()/TIMER_TICK_NS;
+}
+
+void close_timers(void) {
+    if (timer_fd >= 0) close(timer_fd);
+    timer_fd = -1;
+}
+
+// Sets the timerfd to the given expiry, or disarms it
+// when the expiry is 0
+static void timer_fd_set(uint64_t expires) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = expires / 1000000000;
+    spec.it_value.tv_nsec = expires % 1000000000;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    timer_fd_expires = expires;
+}
+
+static void timer_unlink(struct timer* timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel[timer->slot] = timer->next;
+    }
+    if (timer->next != NULL) timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->armed = false;
+    timers_pending--;
+}
+
+static int timer_slot(uint64_t expires) {
+    return (expires/TIMER_TICK_NS) % TIMER_WHEEL_SLOTS;
+}
+
+// Timers that are already due are moved up to the
+// tick last walked, which is the first one walked
+// again, so they can't land in a slot behind it
+void timer_arm_at(struct timer* timer, uint64_t expires) {
+    if (timer->armed) timer_cancel(timer);
+
+    uint64_t earliest = wheel_tick*TIMER_TICK_NS;
+    if (expires < earliest) expires = earliest;
+
+    timer->expires = expires;
+    timer->slot = timer_slot(expires);
+    timer->prev = NULL;
+    timer->next = wheel[timer->slot];
+    if (timer->next != NULL) timer->next->prev = timer;
+    wheel[timer->slot] = timer;
+    timer->armed = true;
+    timers_pending++;
+
+    if (timer_fd_expires == 0 || expires < timer_fd_expires) timer_fd_set(expires);
+}
+
+void timer_arm(struct timer* timer, int delay_ms) {
+    timer_arm_at(timer, timer_now() + (uint64_t)delay_ms*1000000);
+}
+
+// A cancelled timer may leave the timerfd set to its
+// expiry, which then causes one wakeup with nothing
+// to do, unless no timer is left at all.
+void timer_cancel(struct timer* timer) {
+    if (!timer->armed) return;
+    timer_unlink(timer);
+    if (timers_pending == 0 && timer_fd_expires != 0) timer_fd_set(0);
+}
+
+int timer_poll_fds(struct pollfd* fds) {
+    fds[0].fd = timer_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    return TIMER_MAX_FDS;
+}
+
+// Runs the callbacks of all due timers. A slot is
+// walked again from its start after every callback,
+// since the callback may arm or cancel other timers.
+// The wheel is moved along with the walk, so that a
+// timer armed already due by a callback is picked up
+// in the slot being walked. The walk starts at the
+// tick it ended at last time, which never lies ahead
+// of the clock.
+static void timer_expire(uint64_t now) {
+    uint64_t now_tick = now/TIMER_TICK_NS;
+    uint64_t first_tick = wheel_tick;
+    if (now_tick-first_tick >= TIMER_WHEEL_SLOTS) first_tick = now_tick-TIMER_WHEEL_SLOTS+1;
+
+    for (uint64_t tick = first_tick; tick <= now_tick; tick++) {
+        wheel_tick = tick;
+        bool expired = true;
+        while (expired) {
+            expired = false;
+            for (struct timer* timer = wheel[tick % TIMER_WHEEL_SLOTS]; timer != NULL; timer = timer->next) {
+                if (timer->expires > now) continue;
+                timer_unlink(timer);
+                timer->callback();
+                expired = true;
+                break;
+            }
+        }
+    }
+    wheel_tick = now_tick;
+}
+
+void timer_poll_events(struct pollfd* fds, int n_fds) {
+    if (!(fds[0].revents & POLLIN)) return;
+
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) return;
+
+    // Timers armed by the callbacks are already in the
+    // wheel, so the next expiry is found afterwards
+    timer_fd_expires = 0;
+    timer_expire(timer_now());
+
+    uint64_t next = 0;
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+        for (struct timer* timer = wheel[slot]; timer != NULL; timer = timer->next) {
+            if (next == 0 || timer->expires < next) next = timer->expires;
+        }
+    }
+    timer_fd_set(next);
+}
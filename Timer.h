@@ -0,0 +1,38 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include "Constants.h"
+
+#define TIMER_MAX_FDS 1
+
+// A one-shot timer on the monotonic clock, with its
+// expiry time in nanoseconds. Timers live in the state
+// of the module that owns them, run on the main thread,
+// and may be armed again from their own callback.
+struct timer {
+    uint64_t expires;
+    void (*callback)(void);
+    bool armed;
+    int slot;
+    struct timer* next;
+    struct timer* prev;
+};
+
+uint64_t timer_now(void);
+void open_timers(void);
+void close_timers(void);
+void timer_arm(struct timer* timer, int delay_ms);
+void timer_arm_at(struct timer* timer, uint64_t expires);
+void timer_cancel(struct timer* timer);
+int timer_poll_fds(struct pollfd* fds);
+void timer_poll_events(struct pollfd* fds, int n_fds);
+
+#endif
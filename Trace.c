@@ -0,0 +1,89 @@
+#include <syslog.h>
+#include <time.h>
+#include "Trace.h"
+
+#ifdef TRACE_HAVE_SDT
+#define TRACE_SEMAPHORE_DEFINE(name) unsigned short tncattach_##name##_semaphore __attribute__((section(".probes")));
+TRACE_PROBES(TRACE_SEMAPHORE_DEFINE)
+#endif
+
+#define TRACE_PROBE_NAME(name) #name,
+const char* trace_probe_names[] = { TRACE_PROBES(TRACE_PROBE_NAME) };
+
+struct trace_entry* trace_ring = NULL;
+_Atomic uint64_t trace_head = 0;
+char* trace_path = NULL;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+extern bool daemonize;
+extern void cleanup(void);
+
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Records are claimed atomically, since the reader
+// threads trace as well. Entries being written while
+// the ring is dumped may show up torn, which is an
+// acceptable price for never blocking the data path.
+void trace_record(int probe, int len, uint64_t timestamp, int64_t arg) {
+    if (trace_ring == NULL) return;
+
+    uint64_t index = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+    struct trace_entry* entry = &trace_ring[index % TRACE_RING_LEN];
+    entry->timestamp = timestamp;
+    entry->probe = probe;
+    entry->len = len;
+    entry->arg = arg;
+}
+
+static void trace_signal_handler(int signal) {
+    trace_dump_requested = 1;
+}
+
+void open_trace(char* path) {
+    trace_ring = calloc(TRACE_RING_LEN, sizeof(struct trace_entry));
+    if (trace_ring == NULL) {
+        printf("Error: Could not allocate trace ring\r\n");
+        cleanup();
+        exit(1);
+    }
+    trace_path = path;
+    signal(SIGUSR1, trace_signal_handler);
+}
+
+// Writes the trace ring to the trace file, oldest
+// entry first. Runs on the main thread after the
+// dump was requested with SIGUSR1.
+void trace_dump(void) {
+    trace_dump_requested = 0;
+    if (trace_ring == NULL) return;
+
+    FILE* file = fopen(trace_path, "w");
+    if (file == NULL) {
+        if (daemonize) {
+            syslog(LOG_ERR, "Could not write trace file %s", trace_path);
+        } else {
+            printf("Error: Could not write trace file %s\r\n", trace_path);
+        }
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+    uint64_t start = head > TRACE_RING_LEN ? head-TRACE_RING_LEN : 0;
+    for (uint64_t i = start; i != head; i++) {
+        struct trace_entry* entry = &trace_ring[i % TRACE_RING_LEN];
+        if (entry->probe >= TRACE_N_PROBES) continue;
+        fprintf(file, "%llu %s %d %lld\n", (unsigned long long)entry->timestamp,
+            trace_probe_names[entry->probe], entry->len, (long long)entry->arg);
+    }
+    fclose(file);
+
+    if (daemonize) {
+        syslog(LOG_NOTICE, "Wrote %d trace entries to %s", (int)(head-start), trace_path);
+    } else {
+        printf("Wrote %d trace entries to %s\r\n", (int)(head-start), trace_path);
+    }
+}
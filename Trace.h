@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include "Constants.h"
+
+// Static probes are compiled in when the SystemTap
+// SDT header is available. Every probe has a
+// semaphore, so that timestamps are only taken
+// while a tracer is attached, or while the built-in
+// trace ring is enabled. Probes carry the frame
+// length, a CLOCK_MONOTONIC timestamp in ns, and
+// one probe specific argument:
+//
+//   if_read       0
+//   filter        1 if the frame was passed, else 0
+//   kiss_encode   Number of escaped bytes
+//   tnc_write     Bytes left in the output queue.
+//                 On serial ports, the timestamp is
+//                 when the queue will have drained.
+//   kiss_decode   Number of escaped bytes
+//   if_write      Bytes written to the interface
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#define TRACE_PROBES(X) X(if_read) X(filter) X(kiss_encode) X(tnc_write) X(kiss_decode) X(if_write)
+
+#define TRACE_PROBE_ID(name) TRACE_ID_##name,
+enum trace_probe { TRACE_PROBES(TRACE_PROBE_ID) TRACE_N_PROBES };
+
+#ifdef TRACE_HAVE_SDT
+#define TRACE_SEMAPHORE_DECLARE(name) extern unsigned short tncattach_##name##_semaphore;
+TRACE_PROBES(TRACE_SEMAPHORE_DECLARE)
+#define TRACE_PROBE_ACTIVE(name) (tncattach_##name##_semaphore != 0)
+#define TRACE_PROBE(name, len, timestamp, arg) DTRACE_PROBE3(tncattach, name, len, timestamp, arg)
+#else
+#define TRACE_PROBE_ACTIVE(name) 0
+#define TRACE_PROBE(name, len, timestamp, arg) do {} while (0)
+#endif
+
+struct trace_entry {
+    uint64_t timestamp;
+    uint32_t probe;
+    int32_t len;
+    int64_t arg;
+};
+
+extern struct trace_entry* trace_ring;
+extern volatile sig_atomic_t trace_dump_requested;
+
+#define TRACE_ACTIVE(name) __builtin_expect(trace_ring != NULL || TRACE_PROBE_ACTIVE(name), 0)
+
+#define TRACE_AT(name, len, timestamp, arg) do { \
+    TRACE_PROBE(name, (len), (timestamp), (arg)); \
+    trace_record(TRACE_ID_##name, (len), (timestamp), (arg)); \
+} while (0)
+
+#define TRACE(name, len, arg) do { \
+    if (TRACE_ACTIVE(name)) TRACE_AT(name, len, trace_now(), arg); \
+} while (0)
+
+uint64_t trace_now(void);
+void trace_record(int probe, int len, uint64_t timestamp, int64_t arg);
+void open_trace(char* path);
+void trace_dump(void);
+
+#endif
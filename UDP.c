@@ -0,0 +1,73 @@
+#include "UDP.h"
+
+extern void cleanup();
+
+// Opens a UDP socket bound to the local port and
+// connected to the remote KISS endpoint, so that
+// plain read and write calls exchange one KISS
+// frame per datagram with that endpoint only.
+int open_udp(char* host, int port, int local_port) {
+    struct addrinfo hints, *result, *rp;
+    char port_str[8];
+    int sockfd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    int gai_result = getaddrinfo(host, port_str, &hints, &result);
+    if (gai_result != 0) {
+        printf("Error resolving host %s: %s\r\n", host, gai_strerror(gai_result));
+        cleanup();
+        exit(1);
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sockfd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (sockfd < 0) continue;
+
+        if (rp->ai_family == AF_INET6) {
+            struct sockaddr_in6 local_addr;
+            memset(&local_addr, 0, sizeof(local_addr));
+            local_addr.sin6_family = AF_INET6;
+            local_addr.sin6_addr = in6addr_any;
+            local_addr.sin6_port = htons(local_port);
+            if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+                close(sockfd);
+                sockfd = -1;
+                continue;
+            }
+        } else {
+            struct sockaddr_in local_addr;
+            memset(&local_addr, 0, sizeof(local_addr));
+            local_addr.sin_family = AF_INET;
+            local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            local_addr.sin_port = htons(local_port);
+            if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+                close(sockfd);
+                sockfd = -1;
+                continue;
+            }
+        }
+
+        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+
+        close(sockfd);
+        sockfd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    if (sockfd < 0) {
+        perror("Could not open UDP socket");
+        cleanup();
+        exit(1);
+    }
+
+    return sockfd;
+}
+
+int close_udp(int fd) {
+    return close(fd);
+}
@@ -0,0 +1,60 @@
+#include "UnixSocket.h"
+
+extern void cleanup();
+
+// Connects to a KISS endpoint on a Unix domain socket.
+// SOCK_SEQPACKET is preferred, since it is connection
+// oriented while preserving frame boundaries. If the
+// peer only offers a datagram socket, SOCK_DGRAM is
+// used with an autobound abstract address, so that
+// the peer has somewhere to send frames back to.
+int open_unix(char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Unix socket path %s is too long\r\n", path);
+        cleanup();
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockfd >= 0) {
+        if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            return sockfd;
+        }
+        close(sockfd);
+    }
+
+    sockfd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("Could not open AF_UNIX socket");
+        cleanup();
+        exit(1);
+    }
+
+    struct sockaddr_un local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    if (bind(sockfd, (struct sockaddr*)&local_addr, sizeof(sa_family_t)) < 0) {
+        perror("Could not bind AF_UNIX socket");
+        close(sockfd);
+        cleanup();
+        exit(1);
+    }
+
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Could not connect Unix socket");
+        close(sockfd);
+        cleanup();
+        exit(1);
+    }
+
+    return sockfd;
+}
+
+int close_unix(int fd) {
+    return close(fd);
+}
@@ -0,0 +1,389 @@
+#include <syslog.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "Uring.h"
+#include "KISS.h"
+
+// Reads on the interface and TNC are kept posted at
+// all times, using registered buffers. Any other poll
+// set members are watched with one-shot poll requests
+// that are re-armed as they fire, so that waiting,
+// reading and re-arming all share one io_uring_enter.
+
+#define URING_MAX_POLLS 32
+
+#define TAG_READ 1ULL
+#define TAG_POLL 2ULL
+#define TAG_CANCEL 4ULL
+
+#define TAG(type, gen, index) (((type) << 56) | (((uint64_t)(gen) & 0xFFFFFFFF) << 16) | (index))
+#define TAG_TYPE(data) ((data) >> 56)
+#define TAG_GEN(data) ((uint32_t)(((data) >> 16) & 0xFFFFFFFF))
+#define TAG_INDEX(data) ((int)((data) & 0xFFFF))
+
+struct uring_read {
+    int fd;
+    bool pending;
+    bool cancelling;
+    bool ready;
+    int result;
+    uint32_t gen;
+    uint8_t* buffer;
+    int buffer_len;
+};
+
+struct uring_poll_entry {
+    int fd;
+    short events;
+    short revents;
+    bool used;
+    bool pending;
+    bool removing;
+    bool seen;
+    uint32_t gen;
+};
+
+int uring_fd = -1;
+unsigned* sq_head;
+unsigned* sq_tail;
+unsigned* sq_mask;
+unsigned* sq_array;
+unsigned sq_entries;
+unsigned* cq_head;
+unsigned* cq_tail;
+unsigned* cq_mask;
+struct io_uring_sqe* sqes;
+struct io_uring_cqe* cqes;
+void* sq_ptr = NULL;
+void* cq_ptr = NULL;
+size_t sq_len;
+size_t cq_len;
+size_t sqes_len;
+unsigned to_submit = 0;
+bool fixed_buffers = false;
+
+uint8_t uring_if_buffer[MTU_MAX] __attribute__((aligned(64)));
+uint8_t uring_tnc_buffer[MAX_PAYLOAD*2+3] __attribute__((aligned(64)));
+
+struct uring_read reads[2] = {
+    { .fd = -1, .buffer = uring_if_buffer, .buffer_len = sizeof(uring_if_buffer) },
+    { .fd = -1, .buffer = uring_tnc_buffer, .buffer_len = sizeof(uring_tnc_buffer) },
+};
+struct uring_poll_entry polls[URING_MAX_POLLS];
+uint32_t uring_gen = 0;
+
+extern bool verbose;
+extern bool daemonize;
+
+static int uring_enter(unsigned submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, uring_fd, submit, min_complete, flags, NULL, 0);
+}
+
+static struct io_uring_sqe* get_sqe(void) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned*)sq_head, memory_order_acquire);
+    unsigned tail = *sq_tail;
+    if (tail-head >= sq_entries) {
+        // The submission queue is full, flush it
+        // to the kernel before queueing more.
+        uring_enter(to_submit, 0, 0);
+        to_submit = 0;
+        head = atomic_load_explicit((_Atomic unsigned*)sq_head, memory_order_acquire);
+        if (tail-head >= sq_entries) return NULL;
+    }
+
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned*)sq_tail, tail+1, memory_order_release);
+    to_submit++;
+    return sqe;
+}
+
+bool open_uring(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring_fd < 0) return false;
+
+    sq_len = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cq_len = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_len > sq_len) sq_len = cq_len;
+        cq_len = sq_len;
+    }
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        close(uring_fd);
+        uring_fd = -1;
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            munmap(sq_ptr, sq_len);
+            close(uring_fd);
+            uring_fd = -1;
+            return false;
+        }
+    }
+
+    sqes_len = params.sq_entries*sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+        munmap(sq_ptr, sq_len);
+        close(uring_fd);
+        uring_fd = -1;
+        return false;
+    }
+
+    sq_head = (void*)((char*)sq_ptr+params.sq_off.head);
+    sq_tail = (void*)((char*)sq_ptr+params.sq_off.tail);
+    sq_mask = (void*)((char*)sq_ptr+params.sq_off.ring_mask);
+    sq_array = (void*)((char*)sq_ptr+params.sq_off.array);
+    sq_entries = params.sq_entries;
+    cq_head = (void*)((char*)cq_ptr+params.cq_off.head);
+    cq_tail = (void*)((char*)cq_ptr+params.cq_off.tail);
+    cq_mask = (void*)((char*)cq_ptr+params.cq_off.ring_mask);
+    cqes = (void*)((char*)cq_ptr+params.cq_off.cqes);
+
+    // Registered buffers save the kernel from mapping
+    // the read buffers on every request. Plain reads are
+    // used if registration is not permitted.
+    struct iovec buffers[2] = {
+        { .iov_base = uring_if_buffer, .iov_len = sizeof(uring_if_buffer) },
+        { .iov_base = uring_tnc_buffer, .iov_len = sizeof(uring_tnc_buffer) },
+    };
+    fixed_buffers = syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_BUFFERS, buffers, 2) == 0;
+
+    return true;
+}
+
+void close_uring(void) {
+    if (uring_fd < 0) return;
+    munmap(sqes, sqes_len);
+    if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_len);
+    munmap(sq_ptr, sq_len);
+    close(uring_fd);
+    uring_fd = -1;
+}
+
+static void post_read(int slot, int fd) {
+    struct uring_read* read = &reads[slot];
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe == NULL) return;
+
+    read->fd = fd;
+    read->gen = ++uring_gen;
+    read->pending = true;
+    read->cancelling = false;
+
+    sqe->opcode = fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)read->buffer;
+    sqe->len = read->buffer_len;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = slot;
+    sqe->user_data = TAG(TAG_READ, read->gen, slot);
+}
+
+static void cancel_request(uint64_t user_data, uint8_t opcode) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe == NULL) return;
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = TAG(TAG_CANCEL, 0, 0);
+}
+
+static struct uring_poll_entry* find_poll(int fd, short events) {
+    struct uring_poll_entry* free_entry = NULL;
+    for (int i = 0; i < URING_MAX_POLLS; i++) {
+        if (polls[i].used && !polls[i].removing && polls[i].fd == fd && polls[i].events == events) return &polls[i];
+        if (!polls[i].used && free_entry == NULL) free_entry = &polls[i];
+    }
+
+    if (free_entry != NULL) {
+        memset(free_entry, 0, sizeof(*free_entry));
+        free_entry->used = true;
+        free_entry->fd = fd;
+        free_entry->events = events;
+    }
+    return free_entry;
+}
+
+static void post_poll(struct uring_poll_entry* entry) {
+    struct io_uring_sqe* sqe = get_sqe();
+    if (sqe == NULL) return;
+
+    entry->gen = ++uring_gen;
+    entry->pending = true;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = entry->fd;
+    sqe->poll32_events = entry->events;
+    sqe->user_data = TAG(TAG_POLL, entry->gen, entry-polls);
+}
+
+static void reap_completions(void) {
+    unsigned head = *cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned*)cq_tail, memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+
+        if (TAG_TYPE(data) == TAG_READ) {
+            struct uring_read* read = &reads[TAG_INDEX(data)];
+            if (read->pending && read->gen == TAG_GEN(data)) {
+                read->pending = false;
+                if (!read->cancelling && res != -ECANCELED) {
+                    read->ready = true;
+                    read->result = res;
+                }
+            }
+        } else if (TAG_TYPE(data) == TAG_POLL) {
+            struct uring_poll_entry* entry = &polls[TAG_INDEX(data)];
+            if (entry->used && entry->pending && entry->gen == TAG_GEN(data)) {
+                entry->pending = false;
+                if (entry->removing) {
+                    entry->used = false;
+                } else if (res >= 0) {
+                    entry->revents = res;
+                } else if (res != -ECANCELED) {
+                    entry->revents = POLLERR;
+                }
+            }
+        }
+
+        head++;
+    }
+    atomic_store_explicit((_Atomic unsigned*)cq_head, head, memory_order_release);
+}
+
+// Drop-in replacement for poll on the read_loop poll
+// set. The first two members are the interface and
+// TNC, which are served by pre-posted reads whenever
+// only POLLIN is requested for them. Timers run off
+// the timerfd in the poll set, so the timeout is
+// either 0 or -1.
+int uring_poll(struct pollfd* fds, int n_fds, int timeout) {
+    bool ready = false;
+    bool read_used[2] = { false, false };
+    for (int i = 0; i < URING_MAX_POLLS; i++) polls[i].seen = false;
+
+    for (int i = 0; i < n_fds; i++) {
+        fds[i].revents = 0;
+        if (fds[i].fd < 0) continue;
+
+        if (i < 2 && fds[i].events == POLLIN) {
+            struct uring_read* read = &reads[i];
+            read_used[i] = true;
+            if (read->ready && read->fd != fds[i].fd) {
+                // Data read from a replaced descriptor
+                read->ready = false;
+            }
+
+            if (read->ready) {
+                ready = true;
+            } else if (read->pending && read->fd != fds[i].fd) {
+                // The descriptor was replaced, so the stale
+                // read is cancelled before posting a new one.
+                if (!read->cancelling) {
+                    read->cancelling = true;
+                    cancel_request(TAG(TAG_READ, read->gen, i), IORING_OP_ASYNC_CANCEL);
+                }
+            } else if (!read->pending) {
+                post_read(i, fds[i].fd);
+            }
+        } else {
+            struct uring_poll_entry* entry = find_poll(fds[i].fd, fds[i].events);
+            if (entry == NULL) continue;
+            entry->seen = true;
+            if (entry->revents != 0) {
+                ready = true;
+            } else if (!entry->pending) {
+                post_poll(entry);
+            }
+        }
+    }
+
+    // Withdraw requests for descriptors that left the set
+    for (int i = 0; i < 2; i++) {
+        if (!read_used[i] && reads[i].pending && !reads[i].cancelling) {
+            reads[i].cancelling = true;
+            cancel_request(TAG(TAG_READ, reads[i].gen, i), IORING_OP_ASYNC_CANCEL);
+        }
+        if (!read_used[i]) reads[i].ready = false;
+    }
+    for (int i = 0; i < URING_MAX_POLLS; i++) {
+        if (polls[i].used && !polls[i].seen && !polls[i].removing) {
+            if (polls[i].pending) {
+                polls[i].removing = true;
+                cancel_request(TAG(TAG_POLL, polls[i].gen, i), IORING_OP_POLL_REMOVE);
+            } else {
+                polls[i].used = false;
+            }
+        }
+    }
+
+    unsigned min_complete = ready || timeout == 0 ? 0 : 1;
+
+    int result = uring_enter(to_submit, min_complete, min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (result < 0) {
+        result = -errno;
+        if (result == -EINTR) {
+            // Submissions are consumed even when the wait
+            // itself is interrupted by a signal.
+            to_submit = 0;
+            errno = EINTR;
+            return -1;
+        }
+        errno = -result;
+        return -1;
+    }
+    to_submit = 0;
+
+    reap_completions();
+
+    int n_ready = 0;
+    for (int i = 0; i < n_fds; i++) {
+        if (fds[i].fd < 0) continue;
+
+        if (i < 2 && fds[i].events == POLLIN) {
+            if (reads[i].ready && reads[i].fd == fds[i].fd) fds[i].revents = POLLIN;
+        } else {
+            for (int p = 0; p < URING_MAX_POLLS; p++) {
+                if (polls[p].used && !polls[p].removing && polls[p].fd == fds[i].fd && polls[p].events == fds[i].events) {
+                    fds[i].revents = polls[p].revents;
+                    polls[p].revents = 0;
+                    break;
+                }
+            }
+        }
+        if (fds[i].revents != 0) n_ready++;
+    }
+
+    return n_ready;
+}
+
+// Hands out the result of a completed read, which
+// is re-posted on the next call to uring_poll.
+int uring_take_read(int slot, uint8_t** buffer) {
+    struct uring_read* read = &reads[slot];
+    read->ready = false;
+    *buffer = read->buffer;
+    if (read->result < 0) {
+        errno = -read->result;
+        return -1;
+    }
+    return read->result;
+}
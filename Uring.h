@@ -0,0 +1,22 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include "Constants.h"
+
+#define URING_IF 0
+#define URING_TNC 1
+
+bool open_uring(void);
+void close_uring(void);
+int uring_poll(struct pollfd* fds, int n_fds, int timeout);
+int uring_take_read(int slot, uint8_t** buffer);
+
+#endif
@@ -0,0 +1,103 @@
+#!/bin/sh
+# End-to-end benchmark for tncattach. Runs two
+# instances in separate network namespaces, joined
+# by the tncsim virtual TNC pair, and measures
+# goodput, round trip times and CPU time spent by
+# tncattach per megabyte carried. Must run as root.
+#
+# The channel and workloads can be changed through
+# the environment, for example:
+#
+#   BAUD=9600 TXDELAY=50 BER=1e-5 make bench
+
+BAUD=${BAUD:-0}
+TXDELAY=${TXDELAY:-0}
+TURNAROUND=${TURNAROUND:-0}
+BER=${BER:-0}
+LOSS=${LOSS:-0}
+MTU=${MTU:-1400}
+DURATION=${DURATION:-5}
+UDP_RATE=${UDP_RATE:-20000}
+UDP_SIZE=${UDP_SIZE:-1000}
+RTT_COUNT=${RTT_COUNT:-200}
+RTT_SIZE=${RTT_SIZE:-64}
+TNCATTACH_ARGS=${TNCATTACH_ARGS:-}
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+TNCATTACH="$BENCH_DIR/../tncattach"
+WORK_DIR=$(mktemp -d /tmp/tncbench.XXXXXX)
+NS_A=tncbench-a
+NS_B=tncbench-b
+PORT=5201
+
+cleanup() {
+    [ -n "$PERF_PID" ] && kill "$PERF_PID" 2>/dev/null
+    [ -n "$TNC_A_PID" ] && kill -INT "$TNC_A_PID" 2>/dev/null
+    [ -n "$TNC_B_PID" ] && kill -INT "$TNC_B_PID" 2>/dev/null
+    [ -n "$SIM_PID" ] && kill "$SIM_PID" 2>/dev/null
+    wait 2>/dev/null
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT INT TERM
+
+if [ "$(id -u)" != "0" ]; then
+    echo "The benchmark needs root to create network namespaces and interfaces"
+    exit 1
+fi
+
+# CPU time of a process in clock ticks
+cpu_ticks() {
+    awk '{print $14+$15}' /proc/$1/stat
+}
+
+"$BENCH_DIR/tncsim" -b $BAUD -t $TXDELAY -a $TURNAROUND -e $BER -l $LOSS "$WORK_DIR/tnc-a" "$WORK_DIR/tnc-b" &
+SIM_PID=$!
+sleep 0.5
+
+ip netns add $NS_A || exit 1
+ip netns add $NS_B || exit 1
+ip netns exec $NS_A ip link set lo up
+ip netns exec $NS_B ip link set lo up
+
+ip netns exec $NS_A "$TNCATTACH" "$WORK_DIR/tnc-a" 115200 -m $MTU --noipv6 --ipv4 10.77.0.1/24 $TNCATTACH_ARGS > "$WORK_DIR/tnc-a.log" 2>&1 &
+TNC_A_PID=$!
+ip netns exec $NS_B "$TNCATTACH" "$WORK_DIR/tnc-b" 115200 -m $MTU --noipv6 --ipv4 10.77.0.2/24 $TNCATTACH_ARGS > "$WORK_DIR/tnc-b.log" 2>&1 &
+TNC_B_PID=$!
+sleep 1
+
+if ! kill -0 $TNC_A_PID 2>/dev/null || ! kill -0 $TNC_B_PID 2>/dev/null; then
+    echo "tncattach failed to start:"
+    cat "$WORK_DIR"/tnc-*.log
+    exit 1
+fi
+
+ip netns exec $NS_B "$BENCH_DIR/tncperf" server $PORT &
+PERF_PID=$!
+sleep 0.5
+
+echo "Channel: baud=$BAUD txdelay=${TXDELAY}ms turnaround=${TURNAROUND}ms ber=$BER loss=$LOSS mtu=$MTU"
+
+run() {
+    CPU_BEFORE=$(( $(cpu_ticks $TNC_A_PID) + $(cpu_ticks $TNC_B_PID) ))
+    RESULT=$(ip netns exec $NS_A "$BENCH_DIR/tncperf" "$@")
+    CPU_AFTER=$(( $(cpu_ticks $TNC_A_PID) + $(cpu_ticks $TNC_B_PID) ))
+    echo "$RESULT" | awk -v ticks=$((CPU_AFTER-CPU_BEFORE)) -v hz=$(getconf CLK_TCK) '{
+        bytes = 0
+        for (i = 1; i <= NF; i++) {
+            split($i, kv, "=")
+            if (kv[1] == "bytes") bytes = kv[2]
+        }
+        cpu_ms = ticks*1000/hz
+        if (bytes > 0) {
+            printf "%s cpu_ms=%d cpu_ms_per_mb=%.2f\n", $0, cpu_ms, cpu_ms/(bytes/1048576)
+        } else {
+            printf "%s cpu_ms=%d\n", $0, cpu_ms
+        }
+    }'
+}
+
+run tcp 10.77.0.2 $PORT $DURATION
+run udp 10.77.0.2 $PORT $DURATION $UDP_RATE $UDP_SIZE
+run rtt 10.77.0.2 $PORT $RTT_COUNT $RTT_SIZE
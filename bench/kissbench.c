@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/utsname.h>
+#include "../Constants.h"
+#include "../KISS.h"
+
+// Microbenchmark for the KISS codec. KISS.c is linked
+// in as is, with the rest of tncattach replaced by
+// the stubs below, and frames are decoded without an
+// interface to deliver them to. Results are written
+// as CSV, one line per operation, payload and size.
+
+#define BENCH_MIN_TIME_NS 100000000ULL
+#define BENCH_BATCH 64
+
+bool verbose = false;
+bool daemonize = false;
+bool kiss_server = false;
+bool shm_rings = false;
+bool threaded = false;
+bool dedup_frames = false;
+int bond_links = 0;
+bool bond_striped = false;
+int kiss_ports = 1;
+int attached_if = -1;
+int device_type = 0;
+int baudrate = 0;
+char if_name[IFNAMSIZ] = "bench";
+char port_if_names[KISS_MAX_PORTS][IFNAMSIZ];
+
+void cleanup(void) { }
+void server_broadcast(uint8_t* frame, int frame_len) { }
+void shm_deliver(uint8_t* frame, int frame_len) { }
+bool pipeline_rx_push(uint8_t* frame, int frame_len) { return true; }
+void bond_reorder(int link, uint8_t* frame, int frame_len) { }
+void ports_deliver(int port, uint8_t* frame, int frame_len) { }
+
+uint8_t payload[MAX_PAYLOAD];
+uint8_t encoded[MAX_PAYLOAD*2+3];
+volatile uint32_t sink;
+
+int sizes[] = { TUN_MIN_FRAME_SIZE, 64, 128, 256, 576, 1024, MTU_MAX };
+const char* distributions[] = { "fend", "random", "ascii", "ipv4_tcp" };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void fill_payload(const char* distribution, int size) {
+    if (strcmp(distribution, "fend") == 0) {
+        memset(payload, FEND, size);
+    } else if (strcmp(distribution, "random") == 0) {
+        for (int i = 0; i < size; i++) payload[i] = random() & 0xFF;
+    } else if (strcmp(distribution, "ascii") == 0) {
+        for (int i = 0; i < size; i++) payload[i] = 0x20 + random() % 95;
+    } else {
+        // A TUN frame carrying an IPv4 TCP segment, with
+        // random header fields and a text payload.
+        for (int i = 0; i < size; i++) payload[i] = 0x20 + random() % 95;
+        uint8_t header[44] = { 0x00, 0x00, 0x08, 0x00, 0x45, 0x00, (size-4) >> 8, (size-4) & 0xFF };
+        for (int i = 8; i < 44; i++) header[i] = random() & 0xFF;
+        header[13] = 6;
+        header[36] = 0x50;
+        memcpy(payload, header, size < 44 ? size : 44);
+    }
+}
+
+static void report(const char* operation, const char* distribution, int size, uint64_t frames, uint64_t elapsed, const char* arch) {
+    double ns_per_frame = (double)elapsed/frames;
+    printf("%s,%s,%s,%d,%llu,%.3f,%.1f,%.0f\n", arch, operation, distribution, size, (unsigned long long)frames,
+        ns_per_frame/size, ns_per_frame, 1e9/ns_per_frame);
+}
+
+// Runs batches of an operation until enough time has
+// passed for a stable measurement.
+#define BENCH_LOOP(frames, elapsed, body) do { \
+    uint64_t start = now_ns(); \
+    frames = 0; \
+    do { \
+        for (int batch = 0; batch < BENCH_BATCH; batch++) { body; } \
+        frames += BENCH_BATCH; \
+        elapsed = now_ns()-start; \
+    } while (elapsed < BENCH_MIN_TIME_NS); \
+} while (0)
+
+int main(int argc, char** argv) {
+    struct utsname uts;
+    uname(&uts);
+    srandom(1);
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0) {
+        perror("Could not open /dev/null");
+        return 1;
+    }
+
+    printf("arch,operation,payload,size,frames,ns_per_byte,ns_per_frame,frames_per_sec\n");
+    for (int d = 0; d < (int)(sizeof(distributions)/sizeof(distributions[0])); d++) {
+        for (int s = 0; s < (int)(sizeof(sizes)/sizeof(sizes[0])); s++) {
+            const char* distribution = distributions[d];
+            int size = sizes[s];
+            uint64_t frames, elapsed;
+            fill_payload(distribution, size);
+
+            BENCH_LOOP(frames, elapsed, sink += kiss_encode_frame(encoded, payload, size));
+            report("encode", distribution, size, frames, elapsed, uts.machine);
+
+            BENCH_LOOP(frames, elapsed, sink += kiss_write_frame(null_fd, payload, size));
+            report("write_frame", distribution, size, frames, elapsed, uts.machine);
+
+            int encoded_len = kiss_encode_frame(encoded, payload, size);
+            BENCH_LOOP(frames, elapsed, for (int i = 0; i < encoded_len; i++) kiss_serial_read(encoded[i]));
+            report("decode_stream", distribution, size, frames, elapsed, uts.machine);
+
+            // The datagram decoder leaves its input as it
+            // is, so the same datagram is decoded each time.
+            BENCH_LOOP(frames, elapsed, kiss_datagram_read(encoded, encoded_len));
+            report("decode_datagram", distribution, size, frames, elapsed, uts.machine);
+        }
+    }
+
+    close(null_fd);
+    return 0;
+}
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Traffic generator for the benchmark. Runs as a
+// server in one namespace, answering UDP echo and
+// report requests and sinking TCP streams, and as
+// a client in the other, running one workload and
+// printing its results on a single line.
+
+#define MSG_ECHO 'E'
+#define MSG_DATA 'D'
+#define MSG_RESET 'Z'
+#define MSG_REPORT 'R'
+
+#define RTT_MAX_SAMPLES 100000
+
+uint8_t buffer[65536];
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static struct sockaddr_in make_addr(char* host, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (host == NULL) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", host);
+        exit(1);
+    }
+    return addr;
+}
+
+static int run_server(int port) {
+    struct sockaddr_in addr = make_addr(NULL, port);
+    int one = 1;
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(udp_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || bind(tcp_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(tcp_fd, 1) < 0) {
+        perror("Could not bind server sockets");
+        return 1;
+    }
+
+    uint64_t udp_frames = 0;
+    uint64_t udp_bytes = 0;
+    while (true) {
+        struct pollfd fds[2] = { { udp_fd, POLLIN, 0 }, { tcp_fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in peer;
+            socklen_t peer_len = sizeof(peer);
+            ssize_t len = recvfrom(udp_fd, buffer, sizeof(buffer), 0, (struct sockaddr*)&peer, &peer_len);
+            if (len < 1) continue;
+
+            if (buffer[0] == MSG_ECHO) {
+                sendto(udp_fd, buffer, len, 0, (struct sockaddr*)&peer, peer_len);
+            } else if (buffer[0] == MSG_DATA) {
+                udp_frames++;
+                udp_bytes += len;
+            } else if (buffer[0] == MSG_RESET) {
+                udp_frames = 0;
+                udp_bytes = 0;
+            } else if (buffer[0] == MSG_REPORT) {
+                int report_len = snprintf((char*)buffer, sizeof(buffer), "R %llu %llu", (unsigned long long)udp_frames, (unsigned long long)udp_bytes);
+                sendto(udp_fd, buffer, report_len, 0, (struct sockaddr*)&peer, peer_len);
+            }
+        }
+
+        // Streams are sunk one at a time, and answered
+        // with the number of bytes received.
+        if (fds[1].revents & POLLIN) {
+            int conn_fd = accept(tcp_fd, NULL, NULL);
+            if (conn_fd < 0) continue;
+            uint64_t received = 0;
+            ssize_t len;
+            while ((len = read(conn_fd, buffer, sizeof(buffer))) > 0) received += len;
+            int report_len = snprintf((char*)buffer, sizeof(buffer), "%llu", (unsigned long long)received);
+            ssize_t written = write(conn_fd, buffer, report_len);
+            (void)written;
+            close(conn_fd);
+        }
+    }
+}
+
+static int run_tcp(char* host, int port, double duration) {
+    struct sockaddr_in addr = make_addr(host, port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    // A small send buffer keeps the time spent draining
+    // it after the run short on slow channels.
+    int sndbuf = 8192;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Could not connect");
+        return 1;
+    }
+
+    memset(buffer, 0x55, sizeof(buffer));
+    double start = now_s();
+    while (now_s()-start < duration) {
+        if (write(fd, buffer, 1024) < 0) break;
+    }
+    shutdown(fd, SHUT_WR);
+
+    char report[32] = { 0 };
+    ssize_t len = read(fd, report, sizeof(report)-1);
+    double elapsed = now_s()-start;
+    if (len <= 0) {
+        printf("tcp goodput_kbps=0 error=no_report\n");
+        return 1;
+    }
+    uint64_t received = strtoull(report, NULL, 10);
+    printf("tcp goodput_kbps=%.2f bytes=%llu seconds=%.2f\n", received*8/elapsed/1000, (unsigned long long)received, elapsed);
+    return 0;
+}
+
+static bool udp_request(int fd, char type, char* reply, int reply_size) {
+    for (int attempt = 0; attempt < 5; attempt++) {
+        if (send(fd, &type, 1, 0) < 0) return false;
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 2000) == 1) {
+            ssize_t len = recv(fd, reply, reply_size-1, 0);
+            if (len > 0) {
+                reply[len] = 0;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int run_udp(char* host, int port, double duration, int rate_kbps, int size) {
+    struct sockaddr_in addr = make_addr(host, port);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    char report[64];
+
+    // Resets are sent a few times, since they can be
+    // lost on the channel like anything else.
+    for (int i = 0; i < 3; i++) {
+        char reset = MSG_RESET;
+        send(fd, &reset, 1, 0);
+        usleep(200000);
+    }
+
+    memset(buffer, 0x55, size);
+    buffer[0] = MSG_DATA;
+    double interval = (double)size*8/(rate_kbps*1000.0);
+    double start = now_s();
+    uint64_t sent = 0;
+    while (now_s()-start < duration) {
+        if (send(fd, buffer, size, 0) == size) sent++;
+        double next = start + sent*interval;
+        double wait = next-now_s();
+        if (wait > 0) usleep(wait*1e6);
+    }
+    double elapsed = now_s()-start;
+
+    // Let frames still queued in the TNC drain
+    sleep(2);
+    unsigned long long frames = 0, bytes = 0;
+    if (!udp_request(fd, MSG_REPORT, report, sizeof(report)) || sscanf(report, "R %llu %llu", &frames, &bytes) != 2) {
+        printf("udp goodput_kbps=0 error=no_report\n");
+        return 1;
+    }
+    printf("udp goodput_kbps=%.2f bytes=%llu sent=%llu received=%llu loss_pct=%.2f\n", bytes*8/elapsed/1000, bytes,
+        (unsigned long long)sent, frames, sent > 0 ? 100.0*(sent-frames)/sent : 0);
+    return 0;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run_rtt(char* host, int port, int count, int size) {
+    struct sockaddr_in addr = make_addr(host, port);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (count > RTT_MAX_SAMPLES) count = RTT_MAX_SAMPLES;
+
+    static double samples[RTT_MAX_SAMPLES];
+    int n_samples = 0;
+    memset(buffer, 0x55, size);
+    buffer[0] = MSG_ECHO;
+    for (uint32_t seq = 0; seq < (uint32_t)count; seq++) {
+        memcpy(buffer+1, &seq, sizeof(seq));
+        double sent_at = now_s();
+        send(fd, buffer, size, 0);
+
+        // Late replies to earlier probes are skipped
+        while (true) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 2000) != 1) break;
+            uint8_t reply[65536];
+            ssize_t len = recv(fd, reply, sizeof(reply), 0);
+            uint32_t reply_seq;
+            if (len < 5) continue;
+            memcpy(&reply_seq, reply+1, sizeof(reply_seq));
+            if (reply_seq != seq) continue;
+            samples[n_samples++] = (now_s()-sent_at)*1000;
+            break;
+        }
+    }
+
+    if (n_samples == 0) {
+        printf("rtt samples=0 lost=%d\n", count);
+        return 1;
+    }
+    qsort(samples, n_samples, sizeof(double), compare_doubles);
+    printf("rtt samples=%d lost=%d p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f max_ms=%.2f\n", n_samples, count-n_samples,
+        samples[n_samples*50/100], samples[n_samples*90/100], samples[n_samples*99/100], samples[n_samples-1]);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "server") == 0) return run_server(atoi(argv[2]));
+    if (argc >= 5 && strcmp(argv[1], "tcp") == 0) return run_tcp(argv[2], atoi(argv[3]), atof(argv[4]));
+    if (argc >= 7 && strcmp(argv[1], "udp") == 0) return run_udp(argv[2], atoi(argv[3]), atof(argv[4]), atoi(argv[5]), atoi(argv[6]));
+    if (argc >= 6 && strcmp(argv[1], "rtt") == 0) return run_rtt(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+
+    fprintf(stderr, "Usage: tncperf server PORT\n");
+    fprintf(stderr, "       tncperf tcp HOST PORT SECONDS\n");
+    fprintf(stderr, "       tncperf udp HOST PORT SECONDS RATE_KBPS SIZE\n");
+    fprintf(stderr, "       tncperf rtt HOST PORT COUNT SIZE\n");
+    return 1;
+}
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+#include "../Constants.h"
+#include "../KISS.h"
+
+// Simulates a pair of KISS TNCs sharing one half
+// duplex radio channel. Each TNC is a pty, which
+// tncattach opens like a serial port. Frames are
+// put on the air one at a time, after TXDELAY and,
+// when the transmitting side changes, the turnaround
+// time, and take as long on the air as the baud
+// rate dictates. Frames hit by bit errors are lost,
+// just like a real TNC drops frames failing the CRC.
+
+#define SIM_QUEUE_LEN 256
+#define SIM_FRAME_MAX (MAX_PAYLOAD*2+3)
+
+struct sim_frame {
+    int from;
+    int len;
+    bool lost;
+    uint64_t deliver_at;
+    uint8_t data[SIM_FRAME_MAX];
+};
+
+struct sim_port {
+    int master_fd;
+    int slave_fd;
+    char* link_path;
+    bool in_frame;
+    int frame_len;
+    uint8_t frame[SIM_FRAME_MAX];
+};
+
+struct sim_port ports[2];
+
+// Frames waiting for the channel, and frames on the
+// air waiting to be delivered, in one FIFO, since
+// frames are put on the air in order of arrival.
+struct sim_frame queue[SIM_QUEUE_LEN];
+int queue_head = 0;
+int queue_count = 0;
+int queue_on_air = 0;
+
+int baud = 0;
+int txdelay = 0;
+int turnaround = 0;
+double ber = 0;
+double loss = 0;
+
+uint64_t channel_free_at = 0;
+int last_sender = -1;
+
+uint64_t frames_in = 0;
+uint64_t frames_delivered = 0;
+uint64_t frames_corrupted = 0;
+uint64_t frames_lost = 0;
+uint64_t frames_overflowed = 0;
+
+volatile sig_atomic_t should_exit = 0;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static void signal_handler(int signal) {
+    should_exit = 1;
+}
+
+static void open_sim_port(struct sim_port* port, char* link_path) {
+    port->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (port->master_fd < 0 || grantpt(port->master_fd) < 0 || unlockpt(port->master_fd) < 0) {
+        perror("Could not allocate pty");
+        exit(1);
+    }
+
+    char* slave_path = ptsname(port->master_fd);
+
+    // The slave side is held open, so that the master
+    // doesn't see a hangup while tncattach restarts.
+    port->slave_fd = open(slave_path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (port->slave_fd < 0) {
+        perror("Could not open pty slave");
+        exit(1);
+    }
+    struct termios tty;
+    tcgetattr(port->slave_fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(port->slave_fd, TCSANOW, &tty);
+
+    unlink(link_path);
+    if (symlink(slave_path, link_path) < 0) {
+        perror("Could not link pty");
+        exit(1);
+    }
+    port->link_path = link_path;
+}
+
+static double sim_random(void) {
+    return (double)random() / ((double)RAND_MAX+1);
+}
+
+// Puts queued frames on the air as soon as the
+// channel allows it, and works out their fate.
+static void schedule_frames(void) {
+    while (queue_on_air < queue_count) {
+        struct sim_frame* frame = &queue[(queue_head+queue_on_air) % SIM_QUEUE_LEN];
+        uint64_t start = now_us();
+        if (channel_free_at > start) start = channel_free_at;
+        if (last_sender != -1 && last_sender != frame->from) start += (uint64_t)turnaround*1000;
+        start += (uint64_t)txdelay*1000;
+
+        // The KISS framing bytes are not sent over the air
+        int bits = (frame->len-3)*8;
+        uint64_t airtime = baud > 0 ? (uint64_t)bits*1000000/baud : 0;
+        frame->deliver_at = start+airtime;
+        channel_free_at = frame->deliver_at;
+        last_sender = frame->from;
+
+        frame->lost = false;
+        if (ber > 0 && sim_random() > pow(1.0-ber, bits)) {
+            frame->lost = true;
+            frames_corrupted++;
+        } else if (loss > 0 && sim_random() < loss) {
+            frame->lost = true;
+            frames_lost++;
+        }
+        queue_on_air++;
+    }
+}
+
+static void deliver_frames(void) {
+    uint64_t now = now_us();
+    while (queue_on_air > 0) {
+        struct sim_frame* frame = &queue[queue_head];
+        if (frame->deliver_at > now) break;
+
+        if (!frame->lost) {
+            int to = 1-frame->from;
+            ssize_t written = write(ports[to].master_fd, frame->data, frame->len);
+            if (written == frame->len) frames_delivered++;
+        }
+
+        queue_head = (queue_head+1) % SIM_QUEUE_LEN;
+        queue_count--;
+        queue_on_air--;
+    }
+}
+
+static void frame_complete(int from, struct sim_port* port) {
+    frames_in++;
+    if (queue_count == SIM_QUEUE_LEN) {
+        frames_overflowed++;
+        return;
+    }
+
+    struct sim_frame* frame = &queue[(queue_head+queue_count) % SIM_QUEUE_LEN];
+    frame->from = from;
+    frame->data[0] = FEND;
+    memcpy(frame->data+1, port->frame, port->frame_len);
+    frame->data[port->frame_len+1] = FEND;
+    frame->len = port->frame_len+2;
+    queue_count++;
+}
+
+// Splits the byte stream from tncattach into frames.
+// Only data frames go on the air, while commands to
+// the TNC are accepted and ignored.
+static void port_read(int index) {
+    struct sim_port* port = &ports[index];
+    uint8_t buffer[4096];
+    ssize_t len = read(port->master_fd, buffer, sizeof(buffer));
+    if (len <= 0) return;
+
+    for (int i = 0; i < len; i++) {
+        if (buffer[i] == FEND) {
+            if (port->in_frame && port->frame_len > 1 && (port->frame[0] & 0x0F) == CMD_DATA) {
+                frame_complete(index, port);
+            }
+            port->in_frame = true;
+            port->frame_len = 0;
+        } else if (port->in_frame && port->frame_len < SIM_FRAME_MAX-2) {
+            port->frame[port->frame_len++] = buffer[i];
+        }
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: tncsim [-b BAUD] [-t TXDELAY_MS] [-a TURNAROUND_MS] [-e BER] [-l LOSS] [-s SEED] LINK_A LINK_B\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    unsigned int seed = 1;
+    while ((opt = getopt(argc, argv, "b:t:a:e:l:s:")) != -1) {
+        switch (opt) {
+            case 'b': baud = atoi(optarg); break;
+            case 't': txdelay = atoi(optarg); break;
+            case 'a': turnaround = atoi(optarg); break;
+            case 'e': ber = atof(optarg); break;
+            case 'l': loss = atof(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (argc-optind != 2) usage();
+    srandom(seed);
+
+    open_sim_port(&ports[0], argv[optind]);
+    open_sim_port(&ports[1], argv[optind+1]);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    while (!should_exit) {
+        struct pollfd fds[2];
+        for (int i = 0; i < 2; i++) {
+            fds[i].fd = ports[i].master_fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int timeout = -1;
+        if (queue_on_air > 0) {
+            uint64_t now = now_us();
+            uint64_t next = queue[queue_head].deliver_at;
+            timeout = next > now ? (int)((next-now+999)/1000) : 0;
+        }
+
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents & POLLIN) port_read(i);
+        }
+        schedule_frames();
+        deliver_frames();
+    }
+
+    fprintf(stderr, "tncsim: %llu frames in, %llu delivered, %llu corrupted, %llu lost, %llu overflowed\n",
+        (unsigned long long)frames_in, (unsigned long long)frames_delivered, (unsigned long long)frames_corrupted,
+        (unsigned long long)frames_lost, (unsigned long long)frames_overflowed);
+
+    unlink(ports[0].link_path);
+    unlink(ports[1].link_path);
+    return 0;
+}
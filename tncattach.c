@@ -6,10 +6,28 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <errno.h>
 #include "Constants.h"
 #include "Serial.h"
 #include "KISS.h"
 #include "TCP.h"
+#include "UDP.h"
+#include "UnixSocket.h"
+#include "Server.h"
+#include "SHM.h"
+#include "Pipeline.h"
+#include "Uring.h"
+#include "Pool.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Replay.h"
+#include "Reattach.h"
+#include "Bond.h"
+#include "Ports.h"
+#include "Priority.h"
+#include "Timer.h"
+#include "Log.h"
 #include "TAP.h"
 
 #define BAUDRATE_DEFAULT 0
@@ -19,14 +37,17 @@
 #define TNC_FD_INDEX 1
 #define N_FDS 2
 
-struct pollfd fds[N_FDS];
+struct pollfd fds[N_FDS+PIPELINE_MAX_FDS+SERVER_MAX_FDS+SHM_MAX_FDS+METRICS_MAX_FDS+REATTACH_MAX_FDS+TCP_MAX_FDS+BOND_MAX_FDS+PORTS_MAX_FDS+TIMER_MAX_FDS];
 
-int attached_tnc;
-int attached_if;
+// Both are -1 until opened, so that cleanup after a
+// failed setup never closes descriptors it does not own
+int attached_tnc = -1;
+int attached_if = -1;
 
 char if_name[IFNAMSIZ];
 
 uint8_t serial_buffer[MTU_MAX];
+uint8_t datagram_buffer[MAX_PAYLOAD*2+3];
 uint8_t if_buffer[MTU_MAX];
 
 bool verbose = false;
@@ -38,6 +59,9 @@ bool set_ipv6 = false;
 bool set_linklocal = false;
 bool set_netmask = false;
 bool kiss_over_tcp = false;
+bool kiss_over_udp = false;
+bool kiss_over_unix = false;
+bool kiss_over_datagram = false;
 char* ipv4_addr;
 char* netmask;
 
@@ -46,22 +70,89 @@ long ipv6_prefixLen;
 
 char* tcp_host;
 int tcp_port;
+extern int tcp_state;
+
+char* serial_port_path = NULL;
+bool serial_reattach = false;
+int outage_policy = OUTAGE_DROP;
+
+bool persist = false;
+char* if_name_arg = NULL;
+
+int udp_local_port = -1;
+char* unix_path;
+
+bool kiss_server = false;
+int server_port = -1;
+char* server_path = NULL;
+
+bool shm_rings = false;
+char* shm_path_arg = NULL;
+
+char* metrics_socket_arg = NULL;
+char* metrics_file_arg = NULL;
+
+char* trace_path_arg = NULL;
+char* capture_path_arg = NULL;
+int capture_snaplen_arg = 0;
+
+char* record_path_arg = NULL;
+char* replay_path_arg = NULL;
+bool replay_paced = false;
+
+bool threaded = false;
+bool dedup_frames = false;
+bool tx_priority = false;
+int if_queues = 1;
+bool use_uring = false;
+int if_thread_cpu = -1;
+int tnc_thread_cpu_arg = -1;
 
 int mtu;
+int baudrate = 0;
 int device_type = IF_TUN;
 
 char* id;
 int id_interval = -1;
-time_t last_id = 0;
+uint64_t last_id = 0;
+uint64_t last_tx = 0;
 bool tx_since_last_id = false;
+extern uint64_t tnc_last_rx;
+
+// Identification is due one interval after the last
+// one, once something has been transmitted since. It
+// is encoded once, and may go out a little early,
+// appended to a data frame or while the channel is
+// idle, to save the TNC a keyup of its own. At the
+// deadline it is sent regardless.
+struct kiss_encoded id_frame;
+void id_due(void);
+struct timer id_timer = { .callback = id_due };
 
 void cleanup(void) {
     if (kiss_over_tcp) {
         close_tcp(attached_tnc);
+    } else if (kiss_over_udp) {
+        close_udp(attached_tnc);
+    } else if (kiss_over_unix) {
+        close_unix(attached_tnc);
     } else {
         close_port(attached_tnc);
     }
+    if (kiss_server) close_server();
+    if (shm_rings) close_shm();
+    if (use_uring) close_uring();
+    close_metrics();
+    close_capture();
+    close_recording();
+    close_reattach();
+    close_bond();
+    close_ports();
     close_tap(attached_if);
+    close_priority();
+    close_pool();
+    close_timers();
+    close_log();
 }
 
 bool is_ipv6(uint8_t* frame) {
@@ -84,47 +175,190 @@ bool is_ipv6(uint8_t* frame) {
     }
 }
 
-time_t time_now(void) {
-    time_t now = time(NULL);
-    if (now == -1) {
-        if (daemonize) {
-            syslog(LOG_ERR, "Could not get system time, exiting now");
-        } else {
-            printf("Error: Could not get system time, exiting now\r\n");
-        }
-        cleanup();
-        exit(1);
-    } else {
-        return now;
-    }
+static uint64_t id_deadline(void) {
+    return last_id + (uint64_t)id_interval*1000000000;
+}
+
+static uint64_t id_window_start(void) {
+    return id_deadline() - (uint64_t)id_interval*10000000*ID_EARLY_PERCENT;
+}
+
+static void id_sent(void) {
+    last_id = timer_now();
+    tx_since_last_id = false;
+    timer_cancel(&id_timer);
 }
 
 void transmit_id(void) {
-    time_t now = time(NULL);
-    int id_len = strlen(id);
+    // Hold identification until the TNC is reachable
+    if (bond_links > 0) {
+        if (!bond_available()) return;
+    } else if (attached_tnc < 0 || (kiss_over_tcp && (tcp_state != TCP_CONNECTED || tcp_backlogged()))) {
+        return;
+    }
+
     if (verbose) {
         if (!daemonize) {
-            printf("Transmitting %d bytes of identification data on %s: %s\r\n", id_len, if_name, id);
+            printf("Transmitting %d bytes of identification data on %s: %s\r\n", id_frame.frame_len, if_name, id);
         }
     }
 
-    uint8_t* id_frame = malloc(strlen(id));
-    memcpy(id_frame, id, id_len);
-    kiss_write_frame(attached_tnc, id_frame, id_len);
-    last_id = now;
-    tx_since_last_id = false;
+    // Every bonded TNC and every port of a multi-port
+    // TNC is a transmitter of its own
+    if (kiss_ports > 1) {
+        ports_transmit_id();
+    } else if (bond_links > 0) {
+        bond_transmit_all(&id_frame, (uint8_t*)id, strlen(id));
+    } else if (kiss_write_encoded(attached_tnc, 0, &id_frame) < 0 && errno == EAGAIN) {
+        return;
+    }
+    id_sent();
+}
+
+void id_due(void) {
+    if (!tx_since_last_id) return;
+
+    // Before the deadline, wait for the channel to
+    // go quiet
+    uint64_t now = timer_now();
+    uint64_t last_activity = last_tx > tnc_last_rx ? last_tx : tnc_last_rx;
+    uint64_t idle_at = last_activity + (uint64_t)ID_IDLE_TIME*1000000;
+    if (now < id_deadline() && now < idle_at) {
+        timer_arm_at(&id_timer, idle_at < id_deadline() ? idle_at : id_deadline());
+        return;
+    }
 
+    transmit_id();
+
+    // Identification held back for an unreachable
+    // TNC is retried until it has been sent
+    if (tx_since_last_id) timer_arm(&id_timer, ID_RETRY_INTERVAL);
+}
+
+// Schedules identification after a data frame was
+// sent, for the start of the window it may go out in
+void id_after_tx(void) {
+    tx_since_last_id = true;
+    if (id_interval != -1 && !id_timer.armed) timer_arm_at(&id_timer, id_window_start());
 }
 
-bool should_id(void) {
-    if (id_interval != -1) {
-        time_t now = time_now();
-        return now > last_id + id_interval;
+// Called when a TNC that can be reattached is lost.
+// The interface stays up while the TNC is away.
+void tnc_link_lost(void) {
+    if (kiss_over_tcp) {
+        tcp_link_lost();
     } else {
-        return false;
+        serial_link_lost();
     }
 }
 
+// A TCP TNC that does not take frames as fast as
+// they come is treated like a short outage, so its
+// frames are held when frames are buffered during
+// outages, and dropped otherwise.
+static void tnc_backpressure(int port, uint8_t* frame, int frame_len, uint64_t read_time) {
+    if (outage_policy == OUTAGE_BUFFER) {
+        outage_enqueue(port, frame, frame_len, read_time);
+    } else {
+        METRIC_INC(drops_tnc_busy);
+        LOG(LOG_INFO, "TNC is not taking data, dropped %d byte frame", frame_len);
+    }
+}
+
+// Sends a data frame from an interface or from a
+// KISS server client to the given port of the TNC.
+// The read time is when the frame was read from the
+// interface, or 0 for frames from other sources.
+// Bonded TNCs handle the loss of a link by themselves.
+void tnc_send(int port, uint8_t* frame, int frame_len, uint64_t read_time) {
+    if (bond_links > 0 ? !bond_available() : (attached_tnc < 0 || (kiss_over_tcp && tcp_state != TCP_CONNECTED))) {
+        outage_enqueue(port, frame, frame_len, read_time);
+    } else if (kiss_over_tcp && bond_links == 0 && tcp_backlogged()) {
+        tnc_backpressure(port, frame, frame_len, read_time);
+    } else {
+        int tnc_written;
+        bool id_appended = false;
+        uint64_t now = timer_now();
+        if (bond_links > 0) {
+            tnc_written = bond_transmit(frame, frame_len);
+            if (tnc_written < 0) return;
+        } else if (id_interval != -1 && kiss_ports == 1 && now >= id_window_start()) {
+            // Identification goes out right behind the frame,
+            // in a datagram of its own on datagram transports,
+            // which carry exactly one frame per datagram
+            if (kiss_over_datagram) {
+                tnc_written = kiss_write_frame(attached_tnc, frame, frame_len);
+                id_appended = tnc_written >= 0 && kiss_write_encoded(attached_tnc, 0, &id_frame) >= 0;
+            } else {
+                tnc_written = kiss_write_frame_appended(attached_tnc, frame, frame_len, &id_frame);
+                id_appended = tnc_written >= 0;
+            }
+            if (id_appended) LOG(LOG_DEBUG, "Appended identification to data frame");
+        } else {
+            tnc_written = kiss_write_port_frame(attached_tnc, port, frame, frame_len);
+        }
+        if (tnc_written < 0 && errno == EAGAIN) {
+            tnc_backpressure(port, frame, frame_len, read_time);
+            return;
+        }
+        LOG(LOG_DEBUG, "Got %d bytes for port %d, wrote %d bytes (KISS-framed and escaped) to TNC", frame_len, port, tnc_written);
+        if (tnc_written < 0 && (kiss_over_tcp || serial_reattach)) {
+            tnc_link_lost();
+            return;
+        }
+        if (bond_links == 0) capture_frame(port, CAPTURE_TX, frame, frame_len, CAPTURE_PASSED);
+        histogram_record(&metrics.tx_sizes, frame_len);
+        if (read_time != 0) histogram_record(&metrics.tx_latency, (metrics_now()-read_time)/1000);
+        last_tx = now;
+
+        if (id_appended) {
+            id_sent();
+        } else {
+            port_tx_since_id[port] = true;
+            id_after_tx();
+        }
+    }
+}
+
+// Frames wait in their priority class until the TNC
+// can take them, when priority classes are in use
+void tnc_transmit(int port, uint8_t* frame, int frame_len, uint64_t read_time) {
+    if (tx_priority) {
+        priority_enqueue(port, frame, frame_len, read_time);
+    } else {
+        tnc_send(port, frame, frame_len, read_time);
+    }
+}
+
+void if_read_failed(void) {
+    if (daemonize) {
+        syslog(LOG_ERR, "Could not read from network interface, exiting now");
+    } else {
+        printf("Error: Could not read from network interface, exiting now\r\n");
+    }
+    cleanup();
+    exit(1);
+}
+
+// Handles a failed or closed TNC read. TCP connections
+// are re-established, and serial ports reattached when
+// requested. Other transports end the program.
+void tnc_read_failed(void) {
+    if (kiss_over_tcp || serial_reattach) {
+        tnc_link_lost();
+        return;
+    }
+
+    if (daemonize) {
+        syslog(LOG_ERR, "Could not read from TNC, exiting now");
+    } else {
+        printf("Error: Could not read from TNC, exiting now\r\n");
+    }
+
+    cleanup();
+    exit(1);
+}
+
 void signal_handler(int signal) {
     if (daemonize) syslog(LOG_NOTICE, "tncattach daemon exiting");
 
@@ -135,14 +369,32 @@ void signal_handler(int signal) {
     exit(0);
 }
 
+// Filters a frame read from the interface, and
+// passes it on to the TNC
+void if_frame_read(uint8_t* frame, int frame_len) {
+    int min_frame_size = device_type == IF_TAP ? ETHERNET_MIN_FRAME_SIZE : TUN_MIN_FRAME_SIZE;
+    uint64_t read_time = metrics_now();
+    METRIC_INC(if_rx_frames);
+    METRIC_ADD(if_rx_bytes, frame_len);
+    TRACE_AT(if_read, frame_len, read_time, 0);
+    if (frame_len >= min_frame_size) {
+        if (!noipv6 || (noipv6 && !is_ipv6(frame))) {
+            TRACE(filter, frame_len, 1);
+            tnc_transmit(0, frame, frame_len, read_time);
+        } else {
+            METRIC_INC(filter_ipv6);
+            TRACE(filter, frame_len, 0);
+            capture_frame(0, CAPTURE_TX, frame, frame_len, CAPTURE_FILTERED);
+        }
+    } else {
+        METRIC_INC(filter_undersized);
+        TRACE(filter, frame_len, 0);
+    }
+}
+
 void read_loop(void) {
     bool should_continue = true;
-    int min_frame_size;
-    if (device_type == IF_TAP) {
-        min_frame_size = ETHERNET_MIN_FRAME_SIZE;
-    } else if (device_type == IF_TUN) {
-        min_frame_size = TUN_MIN_FRAME_SIZE;
-    } else {
+    if (device_type != IF_TAP && device_type != IF_TUN) {
         if (daemonize) {
             syslog(LOG_ERR, "Unsupported interface type");
         } else {
@@ -153,19 +405,81 @@ void read_loop(void) {
         exit(1);
     }
 
-    int poll_timeout = 1000;
     while (should_continue) {
-        int poll_result = poll(fds, 2, poll_timeout);
-        if (poll_result != -1) {
-            if (poll_result == 0) {
-                // No resources are ready for reading,
-                // run scheduled tasks instead.
-                if (id_interval != -1 && tx_since_last_id) {
-                    time_t now = time_now();
-                    if (now > last_id + id_interval) transmit_id();
-                }
+        // Everything that is scheduled runs off the
+        // timerfd, so poll only returns for events
+        int poll_timeout = -1;
+        if (kiss_over_tcp) {
+            // While the TCP connection is down, the TNC is
+            // left out of the poll set until the reconnect
+            // timer has opened a new connection.
+            // A connect in progress, and a TNC that has
+            // fallen behind, are waited for to be writable.
+            fds[TNC_FD_INDEX].fd = attached_tnc;
+            if (tcp_state == TCP_CONNECTING) {
+                fds[TNC_FD_INDEX].events = POLLOUT;
             } else {
+                fds[TNC_FD_INDEX].events = tcp_backlogged() ? POLLIN | POLLOUT : POLLIN;
+            }
+        } else if (serial_reattach) {
+            // Likewise for a serial port waiting to
+            // be reattached
+            fds[TNC_FD_INDEX].fd = attached_tnc;
+        }
+
+        if (threaded) {
+            // The reader threads own the interface and TNC
+            // descriptors. A TCP TNC is only waited for here
+            // to be writable.
+            fds[IF_FD_INDEX].fd = -1;
+            fds[TNC_FD_INDEX].events &= ~POLLIN;
+            if (!kiss_over_tcp || fds[TNC_FD_INDEX].events == 0) fds[TNC_FD_INDEX].fd = -1;
+        }
+
+        int n_fds = N_FDS;
+        int n_pipeline_fds = 0;
+        int n_server_fds = 0;
+        int n_shm_fds = 0;
+        int n_metrics_fds = 0;
+        int n_reattach_fds = 0;
+        int n_tcp_fds = 0;
+        int n_bond_fds = 0;
+        int n_ports_fds = 0;
+        int n_timer_fds = 0;
+        if (threaded) n_pipeline_fds = pipeline_poll_fds(fds+n_fds);
+        n_fds += n_pipeline_fds;
+        if (kiss_server) n_server_fds = server_poll_fds(fds+n_fds);
+        n_fds += n_server_fds;
+        if (shm_rings) n_shm_fds = shm_poll_fds(fds+n_fds);
+        n_fds += n_shm_fds;
+        n_metrics_fds = metrics_poll_fds(fds+n_fds);
+        n_fds += n_metrics_fds;
+        if (serial_reattach) n_reattach_fds = reattach_poll_fds(fds+n_fds);
+        n_fds += n_reattach_fds;
+        if (kiss_over_tcp) n_tcp_fds = tcp_poll_fds(fds+n_fds);
+        n_fds += n_tcp_fds;
+        if (bond_links > 0) n_bond_fds = bond_poll_fds(fds+n_fds);
+        n_fds += n_bond_fds;
+        if (kiss_ports > 1) n_ports_fds = ports_poll_fds(fds+n_fds);
+        n_fds += n_ports_fds;
+        n_timer_fds = timer_poll_fds(fds+n_fds);
+        n_fds += n_timer_fds;
+
+        int poll_result;
+        if (use_uring) {
+            poll_result = uring_poll(fds, n_fds, poll_timeout);
+        } else {
+            poll_result = poll(fds, n_fds, poll_timeout);
+        }
+        if (trace_dump_requested) trace_dump();
+        if (poll_result == -1 && errno == EINTR) continue;
+        if (poll_result != -1) {
+            if (poll_result > 0) {
                 for (int fdi = 0; fdi < N_FDS; fdi++) {
+                    // The TNC may have been disconnected while
+                    // handling the interface in this iteration
+                    if (fdi == TNC_FD_INDEX && attached_tnc < 0) continue;
+
                     if (fds[fdi].revents != 0) {
                         // Check for hangup event
                         if (fds[fdi].revents & POLLHUP) {
@@ -184,6 +498,10 @@ void read_loop(void) {
                                 } else {
                                     printf("Received hangup from TNC\r\n");
                                 }
+                                if (kiss_over_tcp || serial_reattach) {
+                                    tnc_link_lost();
+                                    continue;
+                                }
                                 cleanup();
                                 exit(1);
                             }
@@ -206,57 +524,104 @@ void read_loop(void) {
                                 } else {
                                     perror("Received error event from TNC\r\n");
                                 }
+                                if (kiss_over_tcp || serial_reattach) {
+                                    tnc_link_lost();
+                                    continue;
+                                }
                                 cleanup();
                                 exit(1);
                             }
                         }
 
+                        // Check for completion of a TCP connect
+                        if (fds[fdi].revents & POLLOUT && fdi == TNC_FD_INDEX && kiss_over_tcp && tcp_state == TCP_CONNECTING) {
+                            if (!tcp_connect_complete(attached_tnc)) {
+                                tcp_link_lost();
+                            } else if (threaded) {
+                                pipeline_start_tnc_reader();
+                            }
+                            continue;
+                        }
+
+                        // Or for a TCP TNC that has caught up
+                        if (fds[fdi].revents & POLLOUT && fdi == TNC_FD_INDEX && kiss_over_tcp) {
+                            tcp_writable();
+                            if (attached_tnc < 0) continue;
+                        }
+
                         // If data is ready, read it
                         if (fds[fdi].revents & POLLIN) {
                             if (fdi == IF_FD_INDEX) {
-                                int if_len = read(attached_if, if_buffer, sizeof(if_buffer));
+                                uint8_t* if_frame = if_buffer;
+                                int if_len;
+                                if (use_uring) {
+                                    if_len = uring_take_read(URING_IF, &if_frame);
+                                } else {
+                                    if_len = read(attached_if, if_buffer, sizeof(if_buffer));
+                                }
+
                                 if (if_len > 0) {
-                                    if (if_len >= min_frame_size) {
-                                        if (!noipv6 || (noipv6 && !is_ipv6(if_buffer))) {
+                                    record_read(REPLAY_SOURCE_IF, if_frame, if_len);
+                                    if_frame_read(if_frame, if_len);
+                                } else {
+                                    if_read_failed();
+                                }
+                            }
 
-                                            int tnc_written = kiss_write_frame(attached_tnc, if_buffer, if_len);
-                                            if (verbose && !daemonize) printf("Got %d bytes from interface, wrote %d bytes (KISS-framed and escaped) to TNC\r\n", if_len, tnc_written);
-                                            tx_since_last_id = true;
+                            if (fdi == TNC_FD_INDEX && kiss_over_datagram) {
+                                // Every datagram carries exactly one KISS frame
+                                uint8_t* tnc_data = datagram_buffer;
+                                int tnc_len;
+                                if (use_uring) {
+                                    tnc_len = uring_take_read(URING_TNC, &tnc_data);
+                                } else {
+                                    tnc_len = read(attached_tnc, datagram_buffer, sizeof(datagram_buffer));
+                                }
 
-                                            if (should_id()) transmit_id();
-                                        }
-                                    }
+                                if (tnc_len > 0) {
+                                    record_read(REPLAY_SOURCE_TNC, tnc_data, tnc_len);
+                                    kiss_datagram_read(tnc_data, tnc_len);
+                                } else if (kiss_over_udp || (tnc_len < 0 && errno == ECONNREFUSED)) {
+                                    // Datagram peers may come and go, and an
+                                    // empty UDP datagram is not an error.
+                                    if (tnc_len < 0) LOG(LOG_INFO, "KISS datagram peer is not reachable");
                                 } else {
-                                    if (daemonize) {
-                                        syslog(LOG_ERR, "Could not read from network interface, exiting now");
-                                    } else {
-                                        printf("Error: Could not read from network interface, exiting now\r\n");
-                                    }
-                                    cleanup();
-                                    exit(1);
+                                    tnc_read_failed();
+                                }
+                            } else if (fdi == TNC_FD_INDEX) {
+                                uint8_t* tnc_data = serial_buffer;
+                                int tnc_len;
+                                if (use_uring) {
+                                    tnc_len = uring_take_read(URING_TNC, &tnc_data);
+                                } else {
+                                    tnc_len = read(attached_tnc, serial_buffer, sizeof(serial_buffer));
                                 }
-                            }
 
-                            if (fdi == TNC_FD_INDEX) {
-                                int tnc_len = read(attached_tnc, serial_buffer, sizeof(serial_buffer));
                                 if (tnc_len > 0) {
+                                    record_read(REPLAY_SOURCE_TNC, tnc_data, tnc_len);
                                     for (int i = 0; i < tnc_len; i++) {
-                                        kiss_serial_read(serial_buffer[i]);
+                                        kiss_serial_read(tnc_data[i]);
                                     }
+                                } else if (tnc_len < 0 && errno == EAGAIN) {
+                                    // TCP sockets are nonblocking
+                                    continue;
                                 } else {
-                                    if (daemonize) {
-                                        syslog(LOG_ERR, "Could not read from TNC, exiting now");
-                                    } else {
-                                        printf("Error: Could not read from TNC, exiting now\r\n");
-                                    }
-
-                                    cleanup();
-                                    exit(1);
+                                    tnc_read_failed();
                                 }
                             }
                         }
                     }
                 }
+
+                if (threaded) pipeline_poll_events(fds+N_FDS, n_pipeline_fds);
+                if (kiss_server) server_poll_events(fds+N_FDS+n_pipeline_fds, n_server_fds);
+                if (shm_rings) shm_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds, n_shm_fds);
+                metrics_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds, n_metrics_fds);
+                if (serial_reattach) reattach_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds+n_metrics_fds, n_reattach_fds);
+                if (kiss_over_tcp) tcp_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds+n_metrics_fds+n_reattach_fds, n_tcp_fds);
+                if (bond_links > 0) bond_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds+n_metrics_fds+n_reattach_fds+n_tcp_fds, n_bond_fds);
+                if (kiss_ports > 1) ports_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds+n_metrics_fds+n_reattach_fds+n_tcp_fds+n_bond_fds, n_ports_fds);
+                timer_poll_events(fds+N_FDS+n_pipeline_fds+n_server_fds+n_shm_fds+n_metrics_fds+n_reattach_fds+n_tcp_fds+n_bond_fds+n_ports_fds, n_timer_fds);
             }
         } else {
             should_continue = false;
@@ -281,10 +646,39 @@ static struct argp_option options[] = {
     { "kisstcp", 'T', 0, 0, "Use KISS over TCP instead of serial port", 8},
     { "tcphost", 'H', "TCP_HOST", 0, "Host to connect to when using KISS over TCP", 9},
     { "tcpport", 'P', "TCP_PORT", 0, "TCP port when using KISS over TCP", 10},
+    { "kissudp", 'U', 0, 0, "Use KISS over UDP instead of serial port", 10},
+    { "udpport", 3, "UDP_PORT", 0, "Local port when using KISS over UDP", 10},
+    { "kissunix", 4, "PATH", 0, "Use KISS over a Unix domain socket", 10},
+    { "server", 5, "PORT", 0, "Share the TNC with KISS clients on a TCP port", 10},
+    { "serverunix", 6, "PATH", 0, "Share the TNC with KISS clients on a Unix socket", 10},
+    { "shm", 7, "PATH", 0, "Offer shared memory frame rings on a socket", 10},
+    { "threads", 8, 0, 0, "Read interface and TNC on separate threads", 10},
+    { "cpus", 9, "IF_CPU,TNC_CPU", 0, "Pin reader threads to CPU cores", 10},
+    { "queues", 22, "N", 0, "Read the interface from N queues with --threads", 10},
+    { "uring", 10, 0, 0, "Use io_uring for the data path when available", 10},
+    { "metrics", 11, "PATH", 0, "Serve metrics on a Unix socket", 10},
+    { "metricsfile", 12, "FILE", 0, "Write metrics to a Prometheus text file", 10},
+    { "trace", 13, "FILE", 0, "Keep a frame trace, written to FILE on SIGUSR1", 10},
+    { "pcap", 14, "FILE", 0, "Capture frames to a pcapng ring file", 10},
+    { "snaplen", 15, "BYTES", 0, "Maximum bytes captured per frame", 10},
+    { "record", 16, "FILE", 0, "Record all TNC and interface reads to FILE", 10},
+    { "replay", 17, "FILE", 0, "Replay a recording instead of attaching a TNC", 10},
+    { "pace", 18, 0, 0, "Replay with the recorded timing", 10},
+    { "reattach", 19, 0, 0, "Wait for a lost serial TNC to reappear", 10},
+    { "persist", 20, 0, 0, "Keep the interface when tncattach exits", 10},
+    { "ifname", 21, "NAME", 0, "Create or attach to the named interface", 10},
+    { "bond", 23, "PORT:BAUD", 0, "Bond another serial TNC into the interface", 10},
+    { "stripe", 24, 0, 0, "Stripe frames over bonded TNCs in order", 10},
+    { "ports", 25, "N", 0, "Attach N ports of a multi-port TNC as interfaces", 10},
+    { "dedup", 26, 0, 0, "Drop copies of frames received within 2 seconds", 10},
+    { "priority", 27, 0, 0, "Send frames to the TNC by DSCP or VLAN priority", 10},
+    { "classlimits", 28, "I,N,B", 0, "Frames queued per priority class", 10},
+    { "airrate", 29, "BPS", 0, "Pace --priority to the bit rate of the channel", 10},
     { "interval", 't', "SECONDS", 0, "Maximum interval between station identifications", 11},
     { "id", 's', "CALLSIGN", 0, "Station identification data", 12},
     { "daemon", 'd', 0, 0, "Run tncattach as a daemon", 13},
     { "verbose", 'v', 0, 0, "Enable verbose output", 14},
+    { "outage", 2, "POLICY", 0, "Drop or buffer frames while the TNC reconnects", 15},
     { 0 }
 };
 
@@ -310,6 +704,8 @@ struct arguments {
     bool noipv6;
     bool noup;
     bool kiss_over_tcp;
+    bool kiss_over_udp;
+    bool kiss_over_unix;
     bool set_tcp_host;
     bool set_tcp_port;
 };
@@ -559,6 +955,173 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->kiss_over_tcp = true;
             break;
 
+        case 'U':
+            arguments->kiss_over_udp = true;
+            break;
+
+        case 3:
+            udp_local_port = atoi(arg);
+            break;
+
+        case 4:
+            arguments->kiss_over_unix = true;
+            unix_path = (char*)malloc(strlen(arg)+1);
+            strcpy(unix_path, arg);
+            break;
+
+        case 5:
+            kiss_server = true;
+            server_port = atoi(arg);
+            if (server_port < 1 || server_port > 65535) {
+                printf("Error: Invalid KISS server port specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 6:
+            kiss_server = true;
+            server_path = (char*)malloc(strlen(arg)+1);
+            strcpy(server_path, arg);
+            break;
+
+        case 7:
+            shm_rings = true;
+            shm_path_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(shm_path_arg, arg);
+            break;
+
+        case 8:
+            threaded = true;
+            break;
+
+        case 9:
+            if (sscanf(arg, "%d,%d", &if_thread_cpu, &tnc_thread_cpu_arg) != 2 || if_thread_cpu < 0 || tnc_thread_cpu_arg < 0) {
+                printf("Error: Invalid CPU cores specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 10:
+            use_uring = true;
+            break;
+
+        case 22:
+            if_queues = atoi(arg);
+            if (if_queues < 1 || if_queues > IF_MAX_QUEUES) {
+                printf("Error: Invalid number of interface queues specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 11:
+            metrics_socket_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(metrics_socket_arg, arg);
+            break;
+
+        case 12:
+            metrics_file_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(metrics_file_arg, arg);
+            break;
+
+        case 13:
+            trace_path_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(trace_path_arg, arg);
+            break;
+
+        case 14:
+            capture_path_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(capture_path_arg, arg);
+            break;
+
+        case 15:
+            capture_snaplen_arg = atoi(arg);
+            if (capture_snaplen_arg < 1 || capture_snaplen_arg > CAPTURE_MAX_SNAPLEN) {
+                printf("Error: Invalid snapshot length specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 16:
+            record_path_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(record_path_arg, arg);
+            break;
+
+        case 17:
+            replay_path_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(replay_path_arg, arg);
+            break;
+
+        case 18:
+            replay_paced = true;
+            break;
+
+        case 19:
+            serial_reattach = true;
+            break;
+
+        case 20:
+            persist = true;
+            break;
+
+        case 21:
+            if (strlen(arg) >= IFNAMSIZ) {
+                printf("Error: Interface name is too long\r\n\r\n");
+                argp_usage(state);
+            }
+            if_name_arg = (char*)malloc(strlen(arg)+1);
+            strcpy(if_name_arg, arg);
+            break;
+
+        case 23:
+            if (!bond_add_link(arg)) {
+                printf("Error: Invalid or too many bonded TNCs specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 24:
+            bond_striped = true;
+            break;
+
+        case 25:
+            kiss_ports = atoi(arg);
+            if (kiss_ports < 1 || kiss_ports > KISS_MAX_PORTS) {
+                printf("Error: Invalid number of KISS ports specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
+        case 26:
+            dedup_frames = true;
+            break;
+
+        case 27:
+            tx_priority = true;
+            break;
+
+        case 28: {
+            int* limits = priority_limits;
+            if (sscanf(arg, "%d,%d,%d", &limits[0], &limits[1], &limits[2]) != PRIORITY_CLASSES) {
+                printf("Error: Invalid priority class limits specified\r\n\r\n");
+                argp_usage(state);
+            }
+            for (int i = 0; i < PRIORITY_CLASSES; i++) {
+                if (limits[i] < 1 || limits[i] > PRIORITY_QUEUE_MAX) {
+                    printf("Error: Priority class limits must be between 1 and %d\r\n\r\n", PRIORITY_QUEUE_MAX);
+                    argp_usage(state);
+                }
+            }
+            break;
+        }
+
+        case 29:
+            air_rate = atoi(arg);
+            if (air_rate < 1) {
+                printf("Error: Invalid air rate specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
         case 'H':
             arguments->set_tcp_host = true;
             tcp_host = (char*)malloc(strlen(arg)+1);
@@ -574,6 +1137,17 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->noup = true;
             break;
 
+        case 2:
+            if (strcmp(arg, "drop") == 0) {
+                outage_policy = OUTAGE_DROP;
+            } else if (strcmp(arg, "buffer") == 0) {
+                outage_policy = OUTAGE_BUFFER;
+            } else {
+                printf("Error: Invalid outage policy specified\r\n\r\n");
+                argp_usage(state);
+            }
+            break;
+
         case ARGP_KEY_ARG:
             // Check if there's now too many text arguments
             if (state->arg_num >= N_ARGS) argp_usage(state);
@@ -582,15 +1156,89 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->args[state->arg_num] = arg;
             break;
 
-        case ARGP_KEY_END:
+        case ARGP_KEY_END: {
+            bool network_tnc = arguments->kiss_over_tcp || arguments->kiss_over_udp || arguments->kiss_over_unix;
+            bool replay = replay_path_arg != NULL;
+
+            // The reader threads own the descriptors
+            // that io_uring would otherwise read from
+            if (threaded && use_uring) {
+                printf("Error: The --threads and --uring options can't be combined\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // Every interface queue has its own reader thread
+            if (if_queues > 1 && !threaded) {
+                printf("Error: The --queues option requires --threads\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // A replay runs on the main thread only, and
+            // is never recorded again
+            if (replay && (threaded || use_uring || record_path_arg != NULL)) {
+                printf("Error: The --replay option can't be combined with --threads, --uring or --record\r\n\r\n");
+                argp_usage(state);
+            }
+            if (replay_paced && !replay) argp_usage(state);
+
+            // Other transports reconnect by themselves
+            if (serial_reattach && (network_tnc || replay)) {
+                printf("Error: The --reattach option can only be used with serial TNCs\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // Recordings hold the reads of a single TNC
+            if (bond_links > 0 && (replay || record_path_arg != NULL)) {
+                printf("Error: The --bond option can't be combined with --replay or --record\r\n\r\n");
+                argp_usage(state);
+            }
+            if (bond_striped && bond_links == 0) {
+                printf("Error: The --stripe option requires --bond\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // The sequence number must fit in a frame
+            // along with the largest packet
+            if (bond_striped && arguments->mtu > MTU_MAX-ETHERNET_MIN_FRAME_SIZE-STRIPE_HEADER_LEN) {
+                printf("Error: The MTU is too large for --stripe\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // Bonded links are paced by the bond itself
+            if (tx_priority && bond_links > 0) {
+                printf("Error: The --priority option can't be combined with --bond\r\n\r\n");
+                argp_usage(state);
+            }
+
+            if (air_rate > 0 && !tx_priority) {
+                printf("Error: The --airrate option requires --priority\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // Further ports are handled on the main thread,
+            // and recordings hold the first port only
+            if (kiss_ports > 1 && (threaded || use_uring || bond_links > 0 || replay || record_path_arg != NULL)) {
+                printf("Error: The --ports option can't be combined with --threads, --uring, --bond, --replay or --record\r\n\r\n");
+                argp_usage(state);
+            }
+
+            // A bonded serial TNC fails over to the other
+            // links instead of ending the program
+            if (bond_links > 0 && !network_tnc) serial_reattach = true;
+
+            // Only one TNC transport can be used, and a
+            // replay takes the place of the TNC
+            if (arguments->kiss_over_tcp + arguments->kiss_over_udp + arguments->kiss_over_unix + replay > 1) argp_usage(state);
+
             // Check if there's too few text arguments
-            if (!arguments->kiss_over_tcp && state->arg_num < N_ARGS) argp_usage(state);
+            if (!network_tnc && !replay && state->arg_num < N_ARGS) argp_usage(state);
 
-            // Check if text arguments were given when
-            // KISS over TCP was specified
-            if (arguments->kiss_over_tcp && state->arg_num != 0) argp_usage(state);
+            // Check if text arguments were given when KISS over
+            // a network transport or a replay was specified
+            if ((network_tnc || replay) && state->arg_num != 0) argp_usage(state);
 
             break;
+        }
 
         default:
             return ARGP_ERR_UNKNOWN;
@@ -631,6 +1279,7 @@ static struct argp argp = {options, parse_opt, args_doc, doc};
 int main(int argc, char **argv) {
     struct arguments arguments;
     signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
 
     arguments.baudrate = BAUDRATE_DEFAULT;
     arguments.mtu = MTU_DEFAULT;
@@ -647,19 +1296,28 @@ int main(int argc, char **argv) {
     arguments.id_interval = -1;
     arguments.valid_id = false;
     arguments.kiss_over_tcp = false;
+    arguments.kiss_over_udp = false;
+    arguments.kiss_over_unix = false;
+    arguments.set_tcp_host = false;
+    arguments.set_tcp_port = false;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
     if (arguments.kiss_over_tcp) kiss_over_tcp = true;
+    if (arguments.kiss_over_udp) kiss_over_udp = true;
+    if (arguments.kiss_over_unix) kiss_over_unix = true;
+    kiss_over_datagram = kiss_over_udp || kiss_over_unix;
 
-    if (!kiss_over_tcp) {
-        arguments.baudrate = atoi(arguments.args[1]);
-    } else {
+    if (kiss_over_tcp || kiss_over_udp) {
+        char* transport = kiss_over_tcp ? "TCP" : "UDP";
         if (!(arguments.set_tcp_host && arguments.set_tcp_port)) {
-            if (!arguments.set_tcp_host) printf("Error: KISS over TCP was requested, but no host was specified\r\n");
-            if (!arguments.set_tcp_port) printf("Error: KISS over TCP was requested, but no port was specified\r\n");
+            if (!arguments.set_tcp_host) printf("Error: KISS over %s was requested, but no host was specified\r\n", transport);
+            if (!arguments.set_tcp_port) printf("Error: KISS over %s was requested, but no port was specified\r\n", transport);
             exit(1);
         }
+        if (udp_local_port == -1) udp_local_port = tcp_port;
+    } else if (!kiss_over_unix && replay_path_arg == NULL) {
+        arguments.baudrate = atoi(arguments.args[1]);
     }
     
     if (arguments.daemon) daemonize = true;
@@ -669,6 +1327,7 @@ int main(int argc, char **argv) {
     if (arguments.set_ipv4) set_ipv4 = true;
     if (arguments.set_netmask) set_netmask = true;
     if (arguments.set_ipv6) set_ipv6 = true;
+    if (arguments.link_local_v6) set_linklocal = true;
     if (arguments.noup) noup = true;
     mtu = arguments.mtu;
 
@@ -679,8 +1338,9 @@ int main(int argc, char **argv) {
             exit(1);
         } else {
             id_interval = arguments.id_interval;
-            id = malloc(strlen(arguments.id));
+            id = malloc(strlen(arguments.id)+1);
             strcpy(id, arguments.id);
+            kiss_encode_once(&id_frame, (uint8_t*)id, strlen(id));
         }
     } else if (arguments.valid_id && arguments.id_interval == -1) {
         printf("Error: Periodic identification requested, but no indentification interval specified\r\n");
@@ -688,20 +1348,69 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    attached_if = open_tap();
+    // Timers may be armed and log statements written
+    // by anything opened below
+    open_log();
+    open_timers();
+
+    // The interface is created like the recorded one
+    if (replay_path_arg != NULL) open_replay(replay_path_arg);
 
-    if (!arguments.kiss_over_tcp) {
-        attached_tnc = open_port(arguments.args[0]);
+    attached_if = open_tap();
+    for (int i = 1; i < if_queues; i++) open_tap_queue();
+    if (kiss_ports > 1) open_ports();
+
+    if (replay_path_arg != NULL) {
+        // Frames for the TNC are encoded and discarded
+        attached_tnc = open("/dev/null", O_WRONLY);
+    } else if (kiss_over_udp) {
+        attached_tnc = open_udp(tcp_host, tcp_port, udp_local_port);
+    } else if (kiss_over_unix) {
+        attached_tnc = open_unix(unix_path);
+    } else if (!kiss_over_tcp) {
+        serial_port_path = arguments.args[0];
+        attached_tnc = open_port(serial_port_path);
+        baudrate = arguments.baudrate;
         if (!setup_port(attached_tnc, arguments.baudrate)) {
             printf("Error during serial port setup");
             return 0;
         }
     } else {
+        // Connection is completed in read_loop, and
+        // retried there if the TNC is not reachable.
         attached_tnc = open_tcp(tcp_host, tcp_port);
+        if (attached_tnc < 0) tcp_link_lost();
+    }
+
+    // The frame pool is sized for the queues that
+    // are in use, so they can never run it dry.
+    int pool_frames = FRAME_POOL_SPARE;
+    if (kiss_server) pool_frames += SERVER_CLIENT_QUEUE_LEN+1;
+    if ((kiss_over_tcp || serial_reattach) && outage_policy == OUTAGE_BUFFER) pool_frames += OUTAGE_QUEUE_LEN;
+    if (bond_striped) pool_frames += BOND_REORDER_WINDOW;
+    if (tx_priority) {
+        for (int i = 0; i < PRIORITY_CLASSES; i++) pool_frames += priority_limits[i];
     }
+    open_pool(pool_frames);
+
+    if (bond_links > 0) open_bond();
+
+    if (kiss_server) open_server(server_port, server_path);
+    if (shm_rings) open_shm(shm_path_arg);
+    open_metrics(metrics_socket_arg, metrics_file_arg);
+    if (trace_path_arg != NULL) open_trace(trace_path_arg);
+    if (capture_path_arg != NULL) open_capture(capture_path_arg, capture_snaplen_arg);
+    if (record_path_arg != NULL) open_recording(record_path_arg);
 
     printf("TNC interface configured as %s\r\n", if_name);
 
+    if (replay_path_arg != NULL) {
+        log_start();
+        run_replay(replay_paced);
+        cleanup();
+        exit(0);
+    }
+
     fds[IF_FD_INDEX].fd = attached_if;
     fds[IF_FD_INDEX].events = POLLIN;
     fds[TNC_FD_INDEX].fd = attached_tnc;
@@ -712,6 +1421,22 @@ int main(int argc, char **argv) {
         syslog(LOG_NOTICE, "tncattach daemon running");
     }
 
+    // Threads are started after daemonizing,
+    // since they would not survive the fork.
+    log_start();
+    if (threaded) pipeline_start(if_thread_cpu, tnc_thread_cpu_arg);
+
+    // Likewise, the ring and its registered buffers
+    // are set up in the process that will use them.
+    if (use_uring && !open_uring()) {
+        if (daemonize) {
+            syslog(LOG_NOTICE, "io_uring is not available, using poll instead");
+        } else {
+            printf("io_uring is not available, using poll instead\r\n");
+        }
+        use_uring = false;
+    }
+
     read_loop();
 
     return 0;